@@ -10,6 +10,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <stdint.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -21,11 +22,16 @@
 
 #include "error.h"
 #include "misc.h"
+#include "nativedev.h"
+#include "prefetch.h"
 #include "version.h"
 
 /* the name of this program */
 char *program_name = ADFCOPY;
 
+/* data blocks read from a file at a time by bulk_write() */
+#define BULK_BLOCKS 128
+
 /* we need to determine the maximum size of a path, using PATH_MAX */
 #ifdef PATH_MAX
 static int pathmax = PATH_MAX;
@@ -51,6 +57,26 @@ static SECTNUM sector;
 /* should directories be created when copying files the non-recursively way? */
 static int opt_force;
 
+/* only print what the copy would take */
+static int opt_plan;
+
+/* blocks the files and directories walked so far would take. the stack */
+/* has a running count for each directory that is being walked          */
+struct plan_dir {
+  long blocks;
+  long cache_bytes;		/* of the directory cache records */
+  struct plan_dir *up;
+};
+
+static long plan_blocks;
+static struct plan_dir *plan_stack;
+static struct plan_dir plan_dest;	/* the destination directory */
+
+/* long options that have no short eqvivalent short option */
+enum {
+  PLAN_OPTION = 1
+};
+
 /* the structures for the adf-image */
 static struct Device *device;
 static struct Volume *volume;
@@ -59,6 +85,7 @@ static struct Volume *volume;
 static struct option long_options[] =
 {
   {"force",     no_argument,            0, 'f'},
+  {"plan",      no_argument,            0, PLAN_OPTION},
   {"help",	no_argument,		0, 'h'},
   {"version",	no_argument,		0, 'V'},
 
@@ -69,65 +96,29 @@ static struct option long_options[] =
 /********************************************************************/
 /*                        disk file-functions                       */
 /********************************************************************/
-/* copies file time from the source file to the adf-file */
+/* updates the entry of a file in its directory's cache. it's exported */
+/* by ADFLib, but not declared in the headers it installs              */
+extern RETCODE adfUpdateCache (struct Volume *vol, struct bEntryBlock *parent,
+			       struct bEntryBlock *entry, BOOL entryLenChg);
+
+/* copies file time from the source file to the adf-file. adfCloseFile() */
+/* dates the header with the current time when it writes it, so it's    */
+/* read back from the block cache afterwards and dated again, and the    */
+/* directory cache along with it                                         */
 void
-adf_copy_file_time (struct Volume *vol, char *filename) {
-  struct File *file;
-  /* SECTNUM nSect; */
-  struct bEntryBlock entry, parent;
+adf_copy_file_time (struct Volume *vol, SECTNUM header_key, time_t mtime)
+{
+  struct bFileHeaderBlock header;
+  struct bEntryBlock parent;
   struct DateTime dt;
-  struct stat st_buf;
   struct tm *local;
-  /* char *adf_filename = filename; //strdup(filename); */
-
-  /* when copying a whole directory, the filename will be something
-     like foo/devs/bar, where "foo" will not be an actual element in
-     the adf-file so we'll strip it off */
-/*   printf("APFIS?\n"); */
-/*   while (*adf_filename) { */
-/*     printf ("%c", *adf_filename); */
-/*     if (*adf_filename == '/') */
-/*       break; */
-/*     adf_filename++; */
-/*   } */
-/*   adf_filename++; */
-/*   printf("\nZE FILENAME = %s\n", adf_filename); */
-
-  adfReadEntryBlock (vol, vol->curDirPtr, &parent);
-  /* nSect = adfNameToEntryBlk (vol, parent.hashTable, basename (filename), &entry, NULL); */
-  adfNameToEntryBlk (vol, parent.hashTable, basename (filename), &entry, NULL);
-
-  file = (struct File*) malloc (sizeof (struct File));
-  if (!file) {
-    error (0, "Can't allocate memory for timestamp copy #1");
-    return;
-  }
 
-  file->fileHdr = (struct bFileHeaderBlock*) malloc (sizeof (struct bFileHeaderBlock));
-  if (!file->fileHdr) {
-    error (0, "Can't allocate memory for timestamp copy #2");
+  if (adfReadEntryBlock (vol, header_key, (struct bEntryBlock *) &header) != RC_OK) {
+    error (0, "Can't read the file header #%ld for the timestamp", (long) header_key);
     return;
   }
 
-  file->currentData = malloc (512 * sizeof (unsigned char));
-  if (!file->currentData) {
-    error (0, "Can't allocate memory for timestamp copy #3");
-    return;
-  }
-
-  file->volume = vol;
-  file->pos = 0;
-  file->posInExtBlk = 0;
-  file->posInDataBlk = 0;
-  file->writeMode = 1;
-  file->currentExt = NULL;
-  file->nDataBlock = 0;
-
-  memcpy(file->fileHdr, &entry, sizeof(struct bFileHeaderBlock));
-  file->eof = TRUE;
-
-  stat (filename, &st_buf);
-  local = localtime (&st_buf.st_mtime);
+  local = localtime (&mtime);
   dt.year = local->tm_year;
   dt.mon  = local->tm_mon + 1;
   dt.day  = local->tm_mday;
@@ -135,17 +126,19 @@ adf_copy_file_time (struct Volume *vol, char *filename) {
   dt.min  = local->tm_min;
   dt.sec  = local->tm_sec;
 
-  /* printf("filename is %s\n", filename); */
-  /* printf("year, month, date is %d %d %d\n", dt.year, dt.mon, dt.day); */
+  adfTime2AmigaTime(dt, &header.days, &header.mins, &header.ticks);
 
-  adfTime2AmigaTime(dt,
-                    &(file->fileHdr->days),
-                    &(file->fileHdr->mins),
-                    &(file->fileHdr->ticks)
-    );
+  /* the bitmap was updated by adfCloseFile(), no need to do it again */
+  if (adfWriteFileHdrBlock (vol, header_key, &header) != RC_OK) {
+    error (0, "Can't write the file header #%ld for the timestamp", (long) header_key);
+    return;
+  }
 
-  adfWriteFileHdrBlock(file->volume, file->fileHdr->headerKey, file->fileHdr);
-  adfUpdateBitmap(file->volume);
+  /* the name and size stay the same, only the date of the entry changes */
+  if (isDIRCACHE (vol->dosType)
+      && (adfReadEntryBlock (vol, header.parent, &parent) != RC_OK
+	  || adfUpdateCache (vol, &parent, (struct bEntryBlock *) &header, FALSE) != RC_OK))
+    error (0, "Can't update the directory cache for the timestamp");
 }
 
 /* validate and change directory within an adf-file */
@@ -269,16 +262,311 @@ adf_make_dir (const char *path)
   free (directory);
 }
 
+/* the host file bulk_write() reads, open or already in memory */
+struct source {
+  int fd;
+  const unsigned char *data;	/* if not NULL, read from here */
+  size_t size, pos;
+};
+
+/* reads 'len' bytes of the host file, or what's left of it. the rest */
+/* of the buffer is cleared                                           */
+static int
+read_chunk (struct source *src, unsigned char *buf, size_t len)
+{
+  size_t got = 0;
+  ssize_t n;
+
+  if (src->data) {
+    got = src->size - src->pos < len ? src->size - src->pos : len;
+    memcpy (buf, src->data + src->pos, got);
+    src->pos += got;
+  }
+
+  while (!src->data && got < len) {
+    n = read (src->fd, buf + got, len - got);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return 0;
+    if (n == 0)
+      break;
+    got += n;
+  }
+
+  memset (buf + got, 0, len - got);
+  return 1;
+}
+
+/* the bitmap word of 'vol' that holds block 'b'. the bitmap has a bit */
+/* per block from block 2 on, set if it's free                         */
+#define BITMAP_WORD(vol, b) \
+  ((uint32_t) (vol)->bitmapTable[((b) - 2) / 32 / BM_SIZE]->map[((b) - 2) / 32 % BM_SIZE])
+
+/* the first block from 'b' on, up to 'end', that is used if 'free' is */
+/* set and free if it isn't. whole words are skipped at once          */
+static long
+skip_forward (struct Volume *vol, long b, long end, int free)
+{
+  uint32_t word;
+  int bit;
+
+  while (b < end) {
+    bit = (b - 2) % 32;
+    word = (free ? ~BITMAP_WORD (vol, b) : BITMAP_WORD (vol, b)) >> bit;
+    if (word)
+      return b + __builtin_ctz (word) < end ? b + __builtin_ctz (word) : end;
+    b += 32 - bit;
+  }
+
+  return end;
+}
+
+/* the first of the blocks before 'b' that are all free if 'free' is */
+/* set and all used if it isn't, going back from 'b'                  */
+static long
+skip_backward (struct Volume *vol, long b, int free)
+{
+  uint32_t word;
+  int bit;
+
+  while (b > 2) {
+    bit = (b - 3) % 32;
+    word = free ? ~BITMAP_WORD (vol, b - 1) : BITMAP_WORD (vol, b - 1);
+    word <<= 31 - bit;
+    if (word)
+      return b - __builtin_clz (word);
+    b -= bit + 1;
+  }
+
+  return 2;
+}
+
+/* the number of the free block of 'vol' nearest to 'near' that starts */
+/* a run of at least 'n' free blocks, or -1. the runs are looked at    */
+/* going out from 'near', first forward and then back, and no further  */
+/* than the best one found so far                                      */
+static long
+nearest_run (struct Volume *vol, long n, long near)
+{
+  long end = vol->lastBlock - vol->firstBlock + 1;
+  long first, a, b, pos, best = -1;
+
+  if (near < 2)
+    near = 2;
+  if (near >= end)
+    near = end - 1;
+
+  /* forward, starting with the run 'near' is in */
+  first = BITMAP_WORD (vol, near) >> (near - 2) % 32 & 1 ? skip_backward (vol, near, 1) : near;
+  for (b = first; b < end; ) {
+    a = skip_forward (vol, b, end, 0);
+    if (best >= 0 && a - near >= labs (best - near))
+      break;
+    b = skip_forward (vol, a, end, 1);
+    if (b - a < n)
+      continue;
+
+    pos = a > near ? a : near + n <= b ? near : b - n;
+    if (best < 0 || labs (pos - near) < labs (best - near))
+      best = pos;
+    if (pos >= near)
+      break;
+  }
+
+  /* back, as long as a run can be closer */
+  for (b = first; b > 2 && best != near; b = a) {
+    b = skip_backward (vol, b, 0);
+    if (best >= 0 && near - (b - n) >= labs (best - near))
+      break;
+    a = skip_backward (vol, b, 1);
+    if (b - a >= n && (best < 0 || near - (b - n) < labs (best - near)))
+      best = b - n;
+  }
+
+  return best;
+}
+
+/* allocates 'n' blocks for a file into 'sects', in one run next to     */
+/* 'near' (the file header) if there is one, so the file is read without */
+/* seeking back and forth. the search goes both ways from there, like    */
+/* AmigaDOS does. a disk with no such run is left to ADFLib              */
+static int
+alloc_blocks (struct Volume *vol, long n, SECTNUM near, SECTNUM *sects)
+{
+  long start, i;
+
+  start = n > 0 ? nearest_run (vol, n, near) : -1;
+  if (start < 0)
+    return adfGetFreeBlocks (vol, n, sects);
+
+  for (i = 0; i < n; i++) {
+    sects[i] = start + i;
+    adfSetBlockUsed (vol, sects[i]);
+  }
+
+  return 1;
+}
+
+/* writes the data blocks 'sects' with the FFS data in 'buf', adjacent */
+/* blocks in one go where the device is ours                           */
+static int
+write_ffs_blocks (struct Volume *vol, SECTNUM *sects, long n, unsigned char *buf)
+{
+  long i, j;
+
+  for (i = 0; i < n; i = j) {
+    for (j = i + 1; j < n && sects[j] == sects[j - 1] + 1; j++)
+      ;
+
+    if (nativedev_write_blocks (vol->dev, vol->firstBlock + sects[i], j - i,
+				buf + i * LOGICAL_BLOCK_SIZE))
+      continue;
+
+    for (; i < j; i++)
+      if (adfWriteDataBlock (vol, sects[i], buf + i * LOGICAL_BLOCK_SIZE) != RC_OK)
+	return 0;
+  }
+
+  return 1;
+}
+
+/* writes the host file 'src' of 'size' bytes to the newly opened 'file' */
+/* in one pass, instead of through adfWriteFile() and its block at a    */
+/* time: the data and extension blocks are allocated together, next to  */
+/* the header where there's room, the block tables are built in memory, */
+/* and the data goes out in chunks. the header is left for              */
+/* adfCloseFile(). returns 0 if nothing was done and the file should be */
+/* written the usual way, -1 on errors, with errno ENOSPC if the file   */
+/* doesn't fit                                                          */
+static int
+bulk_write (struct File *file, struct source *src, off_t size)
+{
+  struct Volume *vol = file->volume;
+  struct bFileHeaderBlock *header = file->fileHdr;
+  struct bFileExtBlock ext;
+  struct bOFSDataBlock ofs;
+  long block_size = vol->datablockSize;
+  long n_data, n_ext, first, i, j, n;
+  SECTNUM *data, *exts;
+  unsigned char *buf;
+  off_t left = size;
+
+  /* the header holds the first table, every extension block another */
+  n_data = (size + block_size - 1) / block_size;
+  n_ext = n_data > MAX_DATABLK ? (n_data - 1) / MAX_DATABLK : 0;
+
+  data = malloc ((n_data + n_ext) * sizeof *data);
+  buf = malloc (BULK_BLOCKS * LOGICAL_BLOCK_SIZE);
+  if (!data || !buf) {
+    free (data);
+    free (buf);
+    return 0;
+  }
+
+  /* a full disk is found out here, before anything is written */
+  if (!alloc_blocks (vol, n_data + n_ext, header->headerKey, data)) {
+    free (data);
+    free (buf);
+    errno = ENOSPC;
+    return -1;
+  }
+  exts = data + n_data;
+
+  for (i = 0; i < n_data; i += n) {
+    n = n_data - i < BULK_BLOCKS ? n_data - i : BULK_BLOCKS;
+    if (!read_chunk (src, buf, n * block_size))
+      goto fail;
+
+    if (isFFS (vol->dosType)) {
+      if (!write_ffs_blocks (vol, data + i, n, buf))
+	goto fail;
+      left -= n * block_size;
+      continue;
+    }
+
+    /* OFS blocks have a header of their own, and are chained */
+    for (j = 0; j < n; j++) {
+      memset (&ofs, 0, sizeof ofs);
+      ofs.type = T_DATA;
+      ofs.headerKey = header->headerKey;
+      ofs.seqNum = i + j + 1;
+      ofs.dataSize = left < block_size ? left : block_size;
+      ofs.nextData = i + j + 1 < n_data ? data[i + j + 1] : 0;
+      memcpy (ofs.data, buf + j * block_size, ofs.dataSize);
+      left -= ofs.dataSize;
+      if (adfWriteDataBlock (vol, data[i + j], &ofs) != RC_OK)
+	goto fail;
+    }
+  }
+
+  /* the tables are filled from their end */
+  for (i = 0; i < n_ext; i++) {
+    memset (&ext, 0, sizeof ext);
+    first = (i + 1) * MAX_DATABLK;
+    ext.type = T_LIST;
+    ext.headerKey = exts[i];
+    ext.highSeq = n_data - first < MAX_DATABLK ? n_data - first : MAX_DATABLK;
+    ext.parent = header->headerKey;
+    ext.extension = i + 1 < n_ext ? exts[i + 1] : 0;
+    ext.secType = ST_FILE;
+    for (j = 0; j < ext.highSeq; j++)
+      ext.dataBlocks[MAX_DATABLK - 1 - j] = data[first + j];
+    if (adfWriteFileExtBlock (vol, exts[i], &ext) != RC_OK)
+      goto fail;
+  }
+
+  /* only now that all of the blocks are there, the header leads to them */
+  header->highSeq = n_data < MAX_DATABLK ? n_data : MAX_DATABLK;
+  header->firstData = n_data ? data[0] : 0;
+  header->extension = n_ext ? exts[0] : 0;
+  for (i = 0; i < header->highSeq; i++)
+    header->dataBlocks[MAX_DATABLK - 1 - i] = data[i];
+
+  /* adfCloseFile() writes the header with the size, and must not */
+  /* write a data block of its own                                */
+  file->pos = size;
+  free (file->currentData);
+  file->currentData = NULL;
+
+  free (data);
+  free (buf);
+  return 1;
+
+ fail:
+  /* the file is left empty */
+  for (i = 0; i < n_data + n_ext; i++)
+    adfSetBlockFree (vol, data[i]);
+  free (data);
+  free (buf);
+  return -1;
+}
+
 int
 copy_file_to_adf (char *filename)
 {
   struct File* file;
-  FILE* in;
+  FILE* in = NULL;
   long n, len;
   unsigned char buf[BUFSIZE];
+  struct stat st;
+  SECTNUM header_key;
+  struct prefetched pre;
+  struct source src;
+  int bulk;
+
+  /* most likely, the file has been read while the last ones were written */
+  if (prefetch_get (filename, &pre)) {
+    memset (&st, 0, sizeof st);
+    st.st_mode = S_IFREG;
+    st.st_size = pre.size;
+    st.st_mtime = pre.mtime;
+  } else {
+    pre.data = NULL;
+    in = fopen (filename, "rb");
+  }
 
-  in = fopen (filename, "rb");
-  if (!in) {
+  if (!pre.data && !in) {
     /* adfCloseFile (file); */  // Is this needed?  /bos 2013-11-22
     /* add more error handling */
     error (0, "Can't open '%s' for reading: %s", filename, strerror (errno));
@@ -289,26 +577,58 @@ copy_file_to_adf (char *filename)
   if (!file) {
     /* add more error handling */
     error (0, "Can't open '%s' for writing. No idea why, perhaps the file exists", filename);
+    if (in)
+      fclose (in);
+    free (pre.data);
     return 0;
   };
 
-  len = BUFSIZE;
-  n = fread (buf, sizeof (unsigned char), len, in);
-  while (!feof (in)) {
-    /* WARNING - adfWriteFile() DOES NOT REPORT ANY ERRORS IF THE DISK IS FULL! */
-    adfWriteFile (file, n, buf);
-    n = fread (buf, sizeof (unsigned char), len, in);
+  /* the time is that of the file we've got open */
+  if (in && fstat (fileno (in), &st) == -1) {
+    st.st_mtime = time (NULL);
+    st.st_mode = 0;
   }
 
-  if (n > 0)
-    adfWriteFile (file, n, buf);
+  /* the size is known up front, all of the file is written at once */
+  src.fd = in ? fileno (in) : -1;
+  src.data = pre.data;
+  src.size = st.st_size;
+  src.pos = 0;
+  bulk = S_ISREG (st.st_mode) ? bulk_write (file, &src, st.st_size) : 0;
+  if (bulk < 0 && errno == ENOSPC)
+    error (0, "Not enough room for '%s' on the image", filename);
+  else if (bulk < 0)
+    error (0, "Can't write '%s' to the image: %s", filename, strerror (errno));
+
+  if (!bulk && pre.data) {
+    if (pre.size > 0)
+      adfWriteFile (file, pre.size, pre.data);
+  } else if (!bulk) {
+    len = BUFSIZE;
+    n = fread (buf, sizeof (unsigned char), len, in);
+    while (!feof (in)) {
+      /* WARNING - adfWriteFile() DOES NOT REPORT ANY ERRORS IF THE DISK IS FULL! */
+      adfWriteFile (file, n, buf);
+      n = fread (buf, sizeof (unsigned char), len, in);
+    }
+
+    if (n > 0)
+      adfWriteFile (file, n, buf);
+  }
 
-  fclose (in);
+  if (in)
+    fclose (in);
+  free (pre.data);
+  header_key = file->fileHdr->headerKey;
   adfCloseFile (file);
 
-  // adfUpdateBitmap() breaks!
-  adf_copy_file_time (volume, filename);
-  // adfUpdateBitmap() breaks!
+  /* nothing is left of what didn't fit */
+  if (bulk < 0) {
+    adfRemoveEntry (volume, volume->curDirPtr, basename (filename));
+    return 0;
+  }
+
+  adf_copy_file_time (volume, header_key, st.st_mtime);
 
   /* notify user what file got copied */
   notify ("%s -> %s:%s\n", filename, adf_path, filename);
@@ -394,6 +714,13 @@ adf_ftw_callback (char *pathname, const struct stat *statptr, int type)
       n_dirs++;
       break;
 
+    case ADF_FTW_DP:
+      /* we're back from the directory. go to the parent directory in the */
+      /* adf and update the sector counter                                */
+      adfParentDir (volume);
+      sector = volume->curDirPtr;
+      break;
+
     case ADF_FTW_DNR:
       /* unreadable directory */
       error (0, "Can't read directory '%s': %s", pathname, strerror (errno));
@@ -444,9 +771,12 @@ process_path (adf_ftw_t *func)
   *ptr++ = '/';
   *ptr = 0;
 
-  if ((dp = opendir (fullpath)) == NULL)
-    /* can't read directory */
-    return (func (fullpath, &statbuf, ADF_FTW_DNR));
+  if ((dp = opendir (fullpath)) == NULL) {
+    /* can't read directory, but it's left all the same */
+    ret = func (fullpath, &statbuf, ADF_FTW_DNR);
+    ptr[-1] = 0;
+    return ret ? func (fullpath, &statbuf, ADF_FTW_DP) : ret;
+  }
 
   /* process all entries in the directory */
   while ((dirp = readdir (dp)) != NULL) {
@@ -471,10 +801,9 @@ process_path (adf_ftw_t *func)
   if (closedir (dp) < 0)
     error (0, "Can't close directory '%s': %s", fullpath, strerror (errno));
 
-  /* we're back from the directory. go to the parent directory in the adf
-     and update the sector counter */
-  adfParentDir (volume);
-  sector = volume->curDirPtr;
+  /* we're back from the directory, call func() for it once more */
+  if (ret)
+    ret = func (fullpath, &statbuf, ADF_FTW_DP);
 
   return ret;
 }
@@ -494,6 +823,114 @@ adf_ftw (char *pathname, adf_ftw_t *func)
   return (process_path (func));
 }
 
+/* the blocks a file of 'size' bytes takes: its header, the data blocks */
+/* (488 bytes of data in each on OFS, 512 on FFS), and an extension    */
+/* block for every 72 data blocks after the first 72                   */
+static long
+file_blocks (off_t size)
+{
+  long n_data = (size + volume->datablockSize - 1) / volume->datablockSize;
+
+  return 1 + n_data + (n_data > MAX_DATABLK ? (n_data - 1) / MAX_DATABLK : 0);
+}
+
+/* adds an entry to the directory cache of the directory being walked */
+static void
+plan_cache_entry (const char *pathname)
+{
+  struct plan_dir *dir = plan_stack ? plan_stack : &plan_dest;
+
+  if (isDIRCACHE (volume->dosType))
+    /* header, size, protection, date, type, name and comment length */
+    dir->cache_bytes += (24 + strlen (basename ((char *) pathname)) + 1 + 1) & ~1;
+}
+
+/* a new directory takes its own block and, on a volume with a directory */
+/* cache, the cache blocks of its entries (at least one)                */
+static long
+dir_blocks (struct plan_dir *dir)
+{
+  long blocks = 1 + dir->blocks;
+
+  if (isDIRCACHE (volume->dosType))
+    blocks += dir->cache_bytes ? (dir->cache_bytes + 487) / 488 : 1;
+
+  return blocks;
+}
+
+/* adds up what every entry would take, and prints it for directories */
+/* with --plan                                                        */
+static int
+plan_callback (char *pathname, const struct stat *statptr, int type)
+{
+  struct plan_dir *dir;
+  long blocks;
+
+  switch (type) {
+    case ADF_FTW_F:
+      /* only regular files are copied */
+      if (!S_ISREG (statptr->st_mode))
+        break;
+
+      blocks = file_blocks (statptr->st_size);
+      plan_cache_entry (pathname);
+      if (!opt_plan)
+        prefetch_add (pathname, statptr);
+      if (plan_stack)
+        plan_stack->blocks += blocks;
+      else
+        plan_blocks += blocks;
+      break;
+
+    case ADF_FTW_D:
+      plan_cache_entry (pathname);
+      dir = calloc (1, sizeof *dir);
+      if (!dir)
+        error (1, "Can't allocate memory: %s", strerror (errno));
+      dir->up = plan_stack;
+      plan_stack = dir;
+      break;
+
+    case ADF_FTW_DP:
+      dir = plan_stack;
+      plan_stack = dir->up;
+      blocks = dir_blocks (dir);
+      if (plan_stack)
+        plan_stack->blocks += blocks;
+      else
+        plan_blocks += blocks;
+      if (opt_plan)
+        printf ("%8ld  %s%c\n", blocks, pathname, DIRSEP);
+      free (dir);
+      break;
+
+    default:
+      /* reported when it's copied */
+      break;
+  }
+
+  return 1;
+}
+
+/* adds what copying 'file' would take to plan_blocks */
+static void
+plan_file (char *file)
+{
+  struct stat statbuf;
+  long before = plan_blocks;
+
+  if (check_destination_dir (file))
+    adf_ftw (file, plan_callback);
+  else if (stat (file, &statbuf) == 0 && S_ISREG (statbuf.st_mode)) {
+    plan_blocks += file_blocks (statbuf.st_size);
+    plan_cache_entry (file);
+    if (!opt_plan)
+      prefetch_add (file, &statbuf);
+    if (opt_plan)
+      printf ("%8ld  %s\n", plan_blocks - before, file);
+  }
+}
+
 /********************************************************************/
 /*                     print version, usage, etc                    */
 /********************************************************************/
@@ -505,6 +942,8 @@ print_usage (int status)
   } else {
     printf ("Usage: %s ADF-FILE FILE(s) DIR(s) ADF-DIRECTORY\n", program_name);
     printf ("Copy file(s) to an adf-image.\n\n");
+    printf ("\t-f, --force          \tcopy even if ADF-DIRECTORY doesn't exist\n");
+    printf ("\t    --plan           \tprint the blocks the copy takes, copy nothing\n");
     printf ("\t-h, --help           \tdisplay this help and exit\n");
     printf ("\t-V, --version        \tdisplay version information and exit\n");
     printf ("\n");
@@ -540,6 +979,10 @@ main (int argc, char *argv[])
         opt_force = 1;
         break;
 
+      case PLAN_OPTION:
+        opt_plan = 1;
+        break;
+
       case 'V':
         print_version ();
         exit (0);
@@ -563,10 +1006,39 @@ main (int argc, char *argv[])
     print_usage (0);
   }
 
-  /* mount the adf-file */
-  if (!mount_adf (adf_image, &device, &volume, READ_WRITE))
+  /* mount the adf-file, a plan only reads it */
+  if (!mount_adf (adf_image, &device, &volume, opt_plan ? READ_ONLY : READ_WRITE))
     exit(1);
 
+  /* ADFLib doesn't notice when the disk runs full, so make sure first */
+  /* that everything fits                                              */
+  if (optind < argc) {
+    long n_free = adfCountFreeBlocks (volume);
+    int i;
+
+    if (opt_plan)
+      printf ("  Blocks  Path\n");
+    for (i = optind; i < argc - 1; i++)
+      plan_file (argv[i]);
+
+    /* the destination exists, but its cache may need more blocks */
+    plan_blocks += (plan_dest.cache_bytes + 487) / 488;
+
+    if (opt_plan) {
+      printf ("%8ld  total, %ld blocks free on %s\n", plan_blocks, n_free, adf_image);
+      cleanup_adflib();
+      return plan_blocks <= n_free ? 0 : 1;
+    }
+
+    if (plan_blocks > n_free)
+      error (1, "Not enough room on '%s': the files take %ld blocks, %ld are free",
+             adf_image, plan_blocks, n_free);
+
+    /* the files are read in the order they were walked, while the */
+    /* image is written here                                       */
+    prefetch_start ();
+  }
+
   adf_path = allocate_path ();
   if (!adf_path)
     error (1, "Can't allocate memory: %s", strerror (errno));
@@ -598,6 +1070,7 @@ main (int argc, char *argv[])
     error (1, "Something's wrong");
   }
 
+  prefetch_finish ();
   printf ("All Done.\n");
 
   cleanup_adflib();
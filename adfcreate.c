@@ -7,15 +7,19 @@
  */
 #include <adflib.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "adfz.h"
 #include "error.h"
 #include "misc.h"
+#include "nativedev.h"
 #include "version.h"
+#include "zfile.h"
 
 /* the name of this program */
 char *program_name = ADFCREATE;
@@ -44,6 +48,16 @@ static struct option long_options[] =
 /********************************************************************/
 /*                        disk file-functions                       */
 /********************************************************************/
+/* does the filename ask for an adfz container? */
+static int
+is_adfz_name (char *filename)
+{
+  size_t len = strlen (filename);
+
+  return len > strlen (ADFZ_SUFFIX)
+    && strcasecmp (filename + len - strlen (ADFZ_SUFFIX), ADFZ_SUFFIX) == 0;
+}
+
 /* create a disk file with the correct size and put a filesystem on it */
 int
 create_disk_image (char *filename, char *disklabel, int filesystem)
@@ -52,21 +66,49 @@ create_disk_image (char *filename, char *disklabel, int filesystem)
   int n_heads   = HEADS;					/* 2 */
   int n_sectors = SECTORS;					/* 11 for DD, 22 for HD */
   struct Device* device;
+  char image[64];
+  char *name = filename;
+  int fd;
 
   if (opt_high_density)
     n_sectors *= 2;
 
-  device = adfCreateDumpDevice (filename, n_tracks, n_heads, n_sectors);
+  /* an adfz container is formatted in memory and packed afterwards */
+  if (is_adfz_name (filename)) {
+    fd = zfile_memfile (image, sizeof image);
+    name = image;
+  } else
+    fd = open (filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    error (0, "Can't create '%s': %s", filename, strerror (errno));
+    return 0;
+  }
+
+  /* only the blocks that are formatted are written, the rest of the */
+  /* image is left as a hole                                         */
+  device = nativedev_create (name, fd, n_tracks, n_heads, n_sectors);
   if (!device) {
     error (0, "Can't open '%s': %s", filename, strerror (errno));
+    close (fd);
     return 0;
   }
 
   if (adfCreateFlop (device, disklabel, filesystem) != RC_OK) {
     error (0, "Can't format '%s': %s", filename, strerror (errno));
-    free (device);
+    adfUnMountDev (device);
+    close (fd);
+    return 0;
+  }
+
+  /* flushes the image */
+  adfUnMountDev (device);
+
+  if (name != filename && !adfz_write (fd, filename)) {
+    error (0, "Can't write '%s': %s", filename, strerror (errno));
+    close (fd);
     return 0;
   }
+  close (fd);
 
   return 1;
 }
@@ -55,8 +55,12 @@ dump_bootblock_to_file (unsigned char *bootblock, char *path, char *filename)
   if (!tmp_filename)
     return 0;
 
-  /* strip extension from file and wipe the path (if any) from it */
-  tmp_filename = strip_extension (basename (filename));
+  /* strip extension from file and wipe the path (if any) from it. */
+  /* standard input has no name to go by                          */
+  if (strcmp (filename, "-") == 0)
+    tmp_filename = strip_extension ("stdin");
+  else
+    tmp_filename = strip_extension (basename (filename));
 
   /* if the user did not specify to dump to a dir, path will be NULL */
   if (!path)
@@ -101,6 +105,8 @@ print_usage (int status)
     printf ("\t-s, --stdout         \twrite everything to stdout\n");
     printf ("\t-h, --help           \tdisplay this help and exit\n");
     printf ("\t-V, --version        \tdisplay version information and exit\n");
+    printf ("\nWith FILE -, the image is read from standard input, and its bootblock\n");
+    printf ("is dumped to 'stdin.bb'.\n");
     printf ("\n");
     print_footer ();
   }
@@ -16,11 +16,12 @@
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
-#include <utime.h>
 
 #include "error.h"
 #include "misc.h"
+#include "nativedev.h"
 #include "version.h"
+#include "writer.h"
 
 /* the name of this program */
 char *program_name = ADFEXTRACT;
@@ -43,37 +44,16 @@ static struct option long_options[] =
   {NULL, 0, NULL, 0}
 };
 
-/* struct array for timestamps */
-#define MAX_FTS 8
-
-struct fts {
-  char   *filename;
-  struct utimbuf utime_buf;
-};
-
-struct fts *file_timestamps;
-static int n_fts = 0;
-static int max_fts = MAX_FTS;
-
 /********************************************************************/
 /*                        disk file-functions                       */
 /********************************************************************/
-/* save the timestamp from the adf-file for later update */
-void
-update_timestamp(char *filename, struct Entry *entry)
+/* the timestamp of the entry in the adf-file */
+static int
+entry_time (struct Entry *entry, struct timespec *ts)
 {
   struct tm time_str;
-  struct utimbuf *utime_buf;
   time_t time_ret;
 
-  if (n_fts == max_fts) {
-    /* array is full, increase it */
-    max_fts += MAX_FTS;
-    file_timestamps = realloc (file_timestamps, sizeof (struct fts) * max_fts);
-  }
-
-  utime_buf = &file_timestamps[n_fts].utime_buf;
-
   time_str.tm_year = entry->year - 1900;
   time_str.tm_mon = entry->month - 1;
   time_str.tm_mday = entry->days;
@@ -83,120 +63,157 @@ update_timestamp(char *filename, struct Entry *entry)
   time_str.tm_isdst = -1;
 
   time_ret = mktime(&time_str);
-  if (time_ret == -1)
-    error (0, "cannot set timestamp for %s", filename);
-  else {
-    utime_buf->actime = time_ret;
-    utime_buf->modtime = time_ret;
-    file_timestamps[n_fts].filename = strdup (filename);
-/*     strcpy(file_timestamps[n_fts].filename, filename); */
-    n_fts++;
+  if (time_ret == -1) {
+    error (0, "cannot set timestamp for %s", entry->name);
+    return 0;
   }
+
+  ts->tv_sec = time_ret;
+  ts->tv_nsec = 0;
+  return 1;
 }
+
+/* the data of an FFS file as runs of the image file, merged where its */
+/* blocks follow each other.  the data blocks are listed in the file   */
+/* header and its extension blocks, each table from its end.  returns  */
+/* the number of runs, or 0 if the blocks don't add up to the file     */
+static int
+file_runs (struct Volume *vol, struct Entry *entry, size_t image_size,
+	   struct wrun **runs)
+{
+  struct bFileExtBlock table;
+  long block, n_blocks, k = 0, n_ext = 0, i;
+  unsigned long left = entry->size;
+  struct wrun *r;
+  off_t offset;
+  size_t len;
+  int n = 0;
+
+  n_blocks = (entry->size + LOGICAL_BLOCK_SIZE - 1) / LOGICAL_BLOCK_SIZE;
+  r = malloc (n_blocks * sizeof *r);
+  if (!r)
+    return 0;
+
+  /* the header has its table, count and extension at the same places */
+  /* as an extension block                                            */
+  if (adfReadEntryBlock (vol, entry->sector, (struct bEntryBlock *) &table) != RC_OK)
+    goto fail;
+
+  for (;;) {
+    if (table.highSeq < 0 || table.highSeq > MAX_DATABLK)
+      goto fail;
+
+    for (i = 0; i < table.highSeq && k < n_blocks; i++, k++) {
+      block = table.dataBlocks[MAX_DATABLK - 1 - i];
+      if (block < 2 || block > vol->lastBlock - vol->firstBlock)
+	goto fail;
+
+      offset = (off_t) (vol->firstBlock + block) * LOGICAL_BLOCK_SIZE;
+      if (offset + LOGICAL_BLOCK_SIZE > image_size)
+	goto fail;
+      len = left < LOGICAL_BLOCK_SIZE ? left : LOGICAL_BLOCK_SIZE;
+      left -= len;
+
+      if (n > 0 && r[n - 1].offset + r[n - 1].len == offset)
+	r[n - 1].len += len;
+      else {
+	r[n].offset = offset;
+	r[n].len = len;
+	n++;
+      }
+    }
+    if (k == n_blocks)
+      break;
+
+    /* the next table, unless the chain is broken or loops */
+    if (table.extension == 0 || ++n_ext > n_blocks / MAX_DATABLK + 1
+	|| adfReadFileExtBlock (vol, table.extension, &table) != RC_OK)
+      goto fail;
+  }
+
+  *runs = r;
+  return n;
+
+ fail:
+  free (r);
+  return 0;
+}
+
 void
-do_extract_file(struct Volume *vol, struct Entry *entry, char* path, unsigned char *extbuf)
+do_extract_file(struct Volume *vol, struct Entry *entry, struct wdir *dir)
 {
-  char *filename;
   char *name = entry->name;
-  FILE *out;
+  struct timespec mtime;
+  const unsigned char *image;
+  unsigned char *data;
+  struct wrun *runs;
   long n_bytes;
   struct File *file;
-
-  /* allocate memory for the path, separator, filename and the trailing separator */
-  filename = malloc (strlen (path) + 1 + strlen (name) + 1);
-  if (!filename) {
-    error (0, "%s: %s", name, strerror (errno));
+  size_t image_size;
+  int fd, n_runs;
+
+  /* FFS data blocks hold nothing but data. from a plain image they are */
+  /* copied to the file as they are, without going through ADFLib       */
+  if (isFFS (vol->dosType) && entry->size > 0
+      && nativedev_source (vol->dev, &fd, &image, &image_size)
+      && (n_runs = file_runs (vol, entry, image_size, &runs)) > 0) {
+    writer_copy (dir, name, fd, image, runs, n_runs, entry_time (entry, &mtime) ? &mtime : NULL);
     return;
   }
 
-  /* construct a full pathname for the file to be extracted (to) */
-  sprintf (filename, "%s%c%s", path, DIRSEP, name);
-  out = fopen (filename, "wb");
-  if (!out) {
-    error (0, "%s: Can't open file for output: %s", filename, strerror (errno));
+  /* the whole file is read at once, and written in the background */
+  data = malloc (entry->size ? entry->size : 1);
+  if (!data) {
+    error (0, "%s: %s", name, strerror (errno));
     return;
   }
 
   /* open the file in the image */
   file = adfOpenFile (vol, name, "r");
   if (!file) {
-    error (0, "%s: Can't read file from image. Access bits: '%s'", filename, access2str (entry->access));
-    fclose (out);
+    error (0, "%s%c%s: Can't read file from image. Access bits: '%s'", writer_path (dir), DIRSEP, name, access2str (entry->access));
+    free (data);
     return;
   }
 
   /* read the file from the image */
-  n_bytes = adfReadFile(file, BUFSIZE, extbuf);
-  while (!adfEndOfFile (file)) {
-    fwrite (extbuf, sizeof (unsigned char), n_bytes, out);
-    n_bytes = adfReadFile (file, BUFSIZE, extbuf);
-  }
-
-  /* write any remaining bytes */
-  if (n_bytes > 0)
-    fwrite (extbuf, sizeof (unsigned char), n_bytes, out);
-
-  /* we're done.  print some extracting info */
-  printf ("Extracted file '%s'\n", filename);
-
-  /* save a copy of the timestamp */
-  update_timestamp (filename, entry);
-
-  /* close both files */
+  n_bytes = entry->size ? adfReadFile (file, entry->size, data) : 0;
   adfCloseFile (file);
-  fclose (out);
 
-  free (filename);
+  /* reported once it's written */
+  writer_file (dir, name, data, n_bytes, entry_time (entry, &mtime) ? &mtime : NULL);
 }
 
 /* the Recursive Extracter(tm) */
 void
-do_extract_tree (struct Volume *vol, struct List* tree, char *path, unsigned char *extbuf)
+do_extract_tree (struct Volume *vol, struct List* tree, struct wdir *parent)
 {
   struct Entry* entry;
-  char *dir;
+  struct timespec mtime;
+  struct wdir *dir;
 
   while(tree) {
     entry = tree->content;
     if (entry->type == ST_DIR) {
-      /* dir */
-      dir = malloc (strlen (path) + 1 + strlen (entry->name) + 1);
-      if (!dir) {
-	error (0, "Can't allocate memory for %s: %s", entry->name, strerror (errno));
-	return;
-      }
-
-      /* dir to create */
-      sprintf (dir, "%s%c%s", path, DIRSEP, entry->name);
-
-      /* show extracting information */
-//      printf ("%s%c\n", dir, DIRSEP);
-
-      if (access (dir, F_OK) == -1) {
-	/* dir does not exist, let's create it */
-	if (mkdir (dir, 0755) == -1) {
-	  error (1, "Can't create '%s': %s", dir, strerror (errno));
-	} else {
-	  notify ("Created dir '%s'.\n", dir);
-          update_timestamp (dir, entry);
-	}
-      }
+      /* dir to create, unless it exists */
+      dir = writer_mkdir (parent, entry->name, entry_time (entry, &mtime) ? &mtime : NULL);
+      if (!dir)
+	error (1, "Can't create '%s%c%s': %s", writer_path (parent), DIRSEP, entry->name, strerror (errno));
 
       if (tree->subdir != NULL) {
 	if (adfChangeDir (vol, entry->name) == RC_OK) {
-	  if (dir) {
-	    do_extract_tree (vol, tree->subdir, dir, extbuf);
-	    free (dir);
-	  } else
-	    do_extract_tree (vol, tree->subdir, entry->name, extbuf);
+	  do_extract_tree (vol, tree->subdir, dir);
 	  adfParentDir (vol);
 	} else {
-	  fprintf (stderr, "ExtractTree: dir \"%s/%s\" not found.\n", path,entry->name);
+	  fprintf (stderr, "ExtractTree: dir \"%s/%s\" not found.\n", writer_path (parent), entry->name);
 	}
       }
+
+      /* dated once its files are written */
+      writer_close (dir);
     } else if (entry->type == ST_FILE) {
       /* file */
-      do_extract_file (vol, entry, path, extbuf);
+      do_extract_file (vol, entry, parent);
     }
 
     tree = tree->next;
@@ -208,13 +225,7 @@ void
 extract_tree (char *filename, char *path, struct Volume *volume)
 {
   struct List *cell, *list;
-  unsigned char *buf;
-
-  buf = malloc (BUFSIZE);
-  if (!buf) {
-    error (0, "Can't allocate memory for extraction of '%s': %s", filename, strerror (errno));
-    return;
-  }
+  struct wdir *root;
 
   print_volume_header (filename, volume);
 
@@ -232,8 +243,15 @@ extract_tree (char *filename, char *path, struct Volume *volume)
     }
   }
 
+  root = writer_root (path);
+  if (!root) {
+    error (0, "Can't open '%s': %s", path, strerror (errno));
+    return;
+  }
+
   cell = list = adfGetRDirEnt (volume, volume->curDirPtr, 1);
-  do_extract_tree (volume, cell, path, buf);
+  do_extract_tree (volume, cell, root);
+  writer_close (root);
 
   putchar ('\n');
   adfFreeDirList (list);
@@ -257,6 +275,7 @@ print_usage (int status)
     printf ("\t-r, --tree           \tlists directory tree contents\n");
     printf ("\t-h, --help           \tdisplay this help and exit\n");
     printf ("\t-V, --version        \tdisplay version information and exit\n");
+    printf ("\nWith FILE -, the image is read from standard input.\n");
     printf ("\n");
     print_footer ();
   }
@@ -271,7 +290,7 @@ int
 main (int argc, char *argv[])
 {
   char *extract_dir = "";
-  int c, i;
+  int c;
   int n_files;
   struct Device *device;
   struct Volume *volume;
@@ -313,8 +332,9 @@ main (int argc, char *argv[])
 
   /* all remaining arguments should be files */
   if (optind < argc) {
-    /* initiate the array for timestamps */
-    file_timestamps = malloc (sizeof(struct fts) * MAX_FTS);
+    /* files are written while the next ones are read */
+    if (!writer_start ())
+      error (1, "Can't start writing: %s", strerror (errno));
 
     while (optind < argc) {
       char *filename = argv[optind++];
@@ -324,17 +344,9 @@ main (int argc, char *argv[])
 	continue;
 
       extract_tree (filename, extract_dir, volume);
-
-      printf ("Updating timestamps...\n");
-      for (i = 0; i < n_fts; i++) {
-        char *filename = file_timestamps[i].filename;
-
-        utime(filename, &file_timestamps[i].utime_buf);
-      }
     }
 
-    if (file_timestamps)
-      free (file_timestamps);
+    writer_finish ();
   }
 
   printf ("All Done.\n");
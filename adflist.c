@@ -159,6 +159,7 @@ print_usage (int status)
     printf ("List files in an adf-image.\n\n");
     printf ("\t-h, --help           \tdisplay this help and exit\n");
     printf ("\t-V, --version        \tdisplay version information and exit\n");
+    printf ("\nWith FILE -, the image is read from standard input.\n");
     printf ("\n");
     print_footer ();
   }
@@ -0,0 +1,155 @@
+/* adfoverlay.c - Create, commit and flatten overlays of adf-images
+ *
+ * adftools - A complete package for maintaining image-files for the best
+ * Amiga-emulator out there: UAE - http://www.freiburg.linux.de/~uae/
+ *
+ * Copyright (C)2002-2015 Rikard Bosnjakovic <bos@hack.org>
+ */
+#include <adflib.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "misc.h"
+#include "overlay.h"
+#include "version.h"
+
+/* the name of this program */
+char *program_name = ADFOVERLAY;
+
+/* what to do with the deltas */
+static int opt_commit;
+static char *opt_flatten;
+
+/* options */
+static struct option long_options[] =
+{
+  {"commit",	no_argument,		0, 'c'},
+  {"flatten",	required_argument,	0, 'f'},
+  {"help",	no_argument,		0, 'h'},
+  {"version",	no_argument,		0, 'V'},
+
+  /* end of options */
+  {NULL, 0, NULL, 0}
+};
+
+/********************************************************************/
+/*                     print version, usage, etc                    */
+/********************************************************************/
+void
+print_usage (int status)
+{
+  if (!status) {
+    notify ("Try '%s --help' for more information.\n", program_name);
+  } else {
+    printf ("Usage: %s BASE DELTA(s)...\n", program_name);
+    printf ("   or: %s --commit DELTA(s)...\n", program_name);
+    printf ("   or: %s --flatten=FILE DELTA\n", program_name);
+    printf ("Create overlays of an adf-image. An overlay (DELTA) is used like any\n");
+    printf ("image, but only the blocks written to it are stored, the rest is read\n");
+    printf ("from the BASE image.\n\n");
+    printf ("\t-c, --commit         \twrite the changes into the base image\n");
+    printf ("\t-f, --flatten=FILE   \twrite base and changes into the new image FILE\n");
+    printf ("\t-h, --help           \tdisplay this help and exit\n");
+    printf ("\t-V, --version        \tdisplay version information and exit\n");
+    printf ("\n");
+    print_footer ();
+  }
+
+  exit (0);
+}
+
+/********************************************************************/
+/*                            here we go                            */
+/********************************************************************/
+int
+main (int argc, char *argv[])
+{
+  char *base = NULL;
+  int c;
+  int n_files;
+  int ret = 1;
+
+  init_adflib();
+
+  /* parse the options */
+  while ((c = getopt_long (argc, argv, "cf:hV", long_options, NULL)) != -1) {
+    switch (c) {
+      case 0:
+	break;
+
+      case 'c':
+	opt_commit = 1;
+	break;
+
+      case 'f':
+	opt_flatten = optarg;
+	break;
+
+      case 'h':
+	print_usage (1);
+	break;
+
+      case 'V':
+	print_version ();
+	exit (0);
+
+      default:
+	print_usage (0);
+    }
+  }
+
+  /* without an action, the first argument is the base image */
+  if (!opt_commit && !opt_flatten && optind < argc)
+    base = argv[optind++];
+
+  n_files = argc - optind;
+  if (n_files == 0) {
+    error (0, "No files specified, nothing to do");
+    print_usage (0);
+  }
+
+  if (opt_commit && opt_flatten) {
+    error (0, "Can't both commit and flatten");
+    print_usage (0);
+  }
+
+  if (opt_flatten && n_files != 1) {
+    error (0, "Only one overlay can be flattened at a time");
+    print_usage (0);
+  }
+
+  while (optind < argc) {
+    char *delta = argv[optind++];
+
+    if (opt_flatten) {
+      if (overlay_flatten (delta, opt_flatten))
+	notify ("Flattened %s into %s.\n", delta, opt_flatten);
+      else {
+	error (0, "Can't flatten '%s' into '%s': %s", delta, opt_flatten, strerror (errno));
+	ret = 0;
+      }
+    } else if (opt_commit) {
+      if (overlay_commit (delta))
+	notify ("Committed %s.\n", delta);
+      else {
+	error (0, "Can't commit '%s': %s", delta, strerror (errno));
+	ret = 0;
+      }
+    } else {
+      if (overlay_create (base, delta))
+	notify ("Created %s on top of %s.\n", delta, base);
+      else {
+	error (0, "Can't create '%s' on top of '%s': %s", delta, base, strerror (errno));
+	ret = 0;
+      }
+    }
+  }
+
+  cleanup_adflib();
+  return ret ? 0 : 1;
+}
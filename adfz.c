@@ -0,0 +1,530 @@
+/* adfz.c - seekable track-compressed images
+ *
+ * adftools - A complete package for maintaining image-files for the best
+ * Amiga-emulator out there: UAE - http://www.freiburg.linux.de/~uae/
+ *
+ * Copyright (C)2002-2015 Rikard Bosnjakovic <bos@hack.org>
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "adfz.h"
+#include "nativedev.h"
+
+/* every track of the image is deflated on its own, so any block can be */
+/* read by inflating at most one track, and a rewrite only has to pack  */
+/* the tracks that changed.  floppies are full of identical (mostly     */
+/* empty) tracks, those are stored once, and tracks of zeros not at all */
+
+#define ADFZ_HEADER  32
+#define ADFZ_ENTRY   16
+#define ADFZ_TRACK   (11 * 512)		/* DD floppies and hardfiles */
+#define ADFZ_HD      (2 * 80 * 22 * 512)	/* size of a HD floppy */
+#define ADFZ_SLOTS   16			/* decoded tracks kept around */
+
+struct adfz_track {
+  uint64_t offset;
+  uint32_t length;
+  uint32_t crc;
+};
+
+struct adfz_slot {
+  long track;
+  unsigned long used;
+  unsigned char *data;
+};
+
+struct adfz {
+  int fd;
+  off_t size;
+  size_t track_size;
+  long n_tracks;
+  struct adfz_track *table;
+  unsigned long clock;
+  struct adfz_slot slots[ADFZ_SLOTS];
+};
+
+static uint32_t
+get32 (const unsigned char *p)
+{
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint64_t
+get64 (const unsigned char *p)
+{
+  return get32 (p) | (uint64_t) get32 (p + 4) << 32;
+}
+
+static void
+put32 (unsigned char *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static void
+put64 (unsigned char *p, uint64_t v)
+{
+  put32 (p, v);
+  put32 (p + 4, v >> 32);
+}
+
+static int
+pread_all (int fd, void *buf, size_t len, off_t offset)
+{
+  unsigned char *p = buf;
+  ssize_t n;
+
+  while (len > 0) {
+    n = pread (fd, p, len, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    p += n;
+    offset += n;
+    len -= n;
+  }
+
+  return 1;
+}
+
+static int
+pwrite_all (int fd, const void *buf, size_t len, off_t offset)
+{
+  const unsigned char *p = buf;
+  ssize_t n;
+
+  while (len > 0) {
+    n = pwrite (fd, p, len, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    p += n;
+    offset += n;
+    len -= n;
+  }
+
+  return 1;
+}
+
+/* length of track 't', the last one may be short */
+static size_t
+track_len (struct adfz *z, long t)
+{
+  off_t left = z->size - (off_t) t * z->track_size;
+
+  return left < z->track_size ? left : z->track_size;
+}
+
+/* reads the header and offset table of the container in 'fd'. the */
+/* descriptor stays the caller's                                   */
+struct adfz *
+adfz_open (int fd)
+{
+  unsigned char hdr[ADFZ_HEADER], *table = NULL;
+  struct adfz *z;
+  long i;
+
+  z = calloc (1, sizeof *z);
+  if (!z)
+    return NULL;
+
+  if (!pread_all (fd, hdr, sizeof hdr, 0)
+      || memcmp (hdr, ADFZ_MAGIC, 4) != 0
+      || get32 (hdr + 4) != ADFZ_VERSION)
+    goto fail;
+
+  z->fd = fd;
+  z->track_size = get32 (hdr + 8);
+  z->n_tracks = get32 (hdr + 12);
+  z->size = get64 (hdr + 16);
+  if (z->track_size == 0 || z->track_size > 1024 * 1024
+      || z->n_tracks != (z->size + z->track_size - 1) / z->track_size)
+    goto fail;
+
+  table = malloc (z->n_tracks * ADFZ_ENTRY + 1);
+  z->table = malloc (z->n_tracks * sizeof *z->table + 1);
+  if (!table || !z->table
+      || !pread_all (fd, table, z->n_tracks * ADFZ_ENTRY, ADFZ_HEADER))
+    goto fail;
+
+  for (i = 0; i < z->n_tracks; i++) {
+    z->table[i].offset = get64 (table + i * ADFZ_ENTRY);
+    z->table[i].length = get32 (table + i * ADFZ_ENTRY + 8);
+    z->table[i].crc = get32 (table + i * ADFZ_ENTRY + 12);
+    if (z->table[i].length > track_len (z, i))
+      goto fail;
+  }
+  free (table);
+
+  for (i = 0; i < ADFZ_SLOTS; i++) {
+    z->slots[i].track = -1;
+    z->slots[i].data = malloc (z->track_size);
+    if (!z->slots[i].data)
+      goto fail;
+  }
+
+  return z;
+
+ fail:
+  free (table);
+  adfz_close (z);
+  return NULL;
+}
+
+off_t
+adfz_size (struct adfz *z)
+{
+  return z->size;
+}
+
+void
+adfz_close (struct adfz *z)
+{
+  int i;
+
+  for (i = 0; i < ADFZ_SLOTS; i++)
+    free (z->slots[i].data);
+  free (z->table);
+  free (z);
+}
+
+/* unpacks track 't' into 'buf' */
+static int
+read_track (struct adfz *z, long t, unsigned char *buf)
+{
+  struct adfz_track *e = &z->table[t];
+  size_t len = track_len (z, t);
+  unsigned char *frame;
+  z_stream strm;
+  int ret;
+
+  if (e->length == 0) {
+    memset (buf, 0, len);
+    return 1;
+  }
+
+  if (e->length == len)
+    return pread_all (z->fd, buf, len, e->offset);
+
+  frame = malloc (e->length);
+  if (!frame)
+    return 0;
+  if (!pread_all (z->fd, frame, e->length, e->offset)) {
+    free (frame);
+    return 0;
+  }
+
+  memset (&strm, 0, sizeof strm);
+  if (inflateInit2 (&strm, -15) != Z_OK) {
+    free (frame);
+    return 0;
+  }
+  strm.next_in = frame;
+  strm.avail_in = e->length;
+  strm.next_out = buf;
+  strm.avail_out = len;
+  ret = inflate (&strm, Z_FINISH);
+  inflateEnd (&strm);
+  free (frame);
+
+  return ret == Z_STREAM_END && strm.avail_out == 0
+    && crc32 (0L, buf, len) == e->crc;
+}
+
+/* the decoded track 't', from the slots if it was read lately */
+static unsigned char *
+get_track (struct adfz *z, long t)
+{
+  struct adfz_slot *slot = &z->slots[0];
+  int i;
+
+  for (i = 0; i < ADFZ_SLOTS; i++) {
+    if (z->slots[i].track == t) {
+      z->slots[i].used = ++z->clock;
+      return z->slots[i].data;
+    }
+    if (z->slots[i].used < slot->used)
+      slot = &z->slots[i];
+  }
+
+  slot->track = -1;
+  if (!read_track (z, t, slot->data))
+    return NULL;
+
+  slot->track = t;
+  slot->used = ++z->clock;
+  return slot->data;
+}
+
+int
+adfz_pread (struct adfz *z, off_t offset, size_t len, unsigned char *buf)
+{
+  unsigned char *data;
+  size_t skip, n;
+  long t;
+
+  if (offset < 0 || offset + len > z->size)
+    return 0;
+
+  while (len > 0) {
+    t = offset / z->track_size;
+    skip = offset % z->track_size;
+    data = get_track (z, t);
+    if (!data)
+      return 0;
+
+    n = track_len (z, t) - skip < len ? track_len (z, t) - skip : len;
+    memcpy (buf, data + skip, n);
+    buf += n;
+    offset += n;
+    len -= n;
+  }
+
+  return 1;
+}
+
+/* is 'buf' all zeros? */
+static int
+is_zero (const unsigned char *buf, size_t len)
+{
+  return len == 0 || (buf[0] == 0 && memcmp (buf, buf + 1, len - 1) == 0);
+}
+
+/* packs the raw image in 'src' into 'dst'. if 'old' is not -1, it is  */
+/* an earlier version of the container, and its frames are reused for */
+/* the tracks that did not change instead of deflating them again     */
+int
+adfz_compress (int src, int old, int dst)
+{
+  unsigned char hdr[ADFZ_HEADER], *table = NULL;
+  unsigned char *buf = NULL, *other = NULL, *cbuf = NULL;
+  struct adfz z, *prev = NULL;
+  struct adfz_track *e;
+  long *hash = NULL, mask, h, t;
+  size_t len;
+  off_t pos;
+  z_stream strm;
+  struct stat st;
+  int ret = 0;
+
+  if (fstat (src, &st) == -1)
+    return 0;
+
+  memset (&z, 0, sizeof z);
+  z.size = st.st_size;
+  z.track_size = ADFZ_TRACK * (z.size == ADFZ_HD ? 2 : 1);
+  z.n_tracks = (z.size + z.track_size - 1) / z.track_size;
+
+  memset (&strm, 0, sizeof strm);
+  if (deflateInit2 (&strm, Z_BEST_COMPRESSION, Z_DEFLATED, -15, 9,
+		    Z_DEFAULT_STRATEGY) != Z_OK)
+    return 0;
+
+  /* tracks by crc, to find identical ones */
+  for (mask = 1; mask < 2 * z.n_tracks; mask <<= 1)
+    ;
+  hash = malloc (mask * sizeof *hash);
+  mask--;
+
+  z.table = calloc (z.n_tracks + 1, sizeof *z.table);
+  table = calloc (z.n_tracks + 1, ADFZ_ENTRY);
+  buf = malloc (z.track_size);
+  other = malloc (z.track_size);
+  cbuf = malloc (deflateBound (&strm, z.track_size));
+  if (!hash || !z.table || !table || !buf || !other || !cbuf)
+    goto out;
+  memset (hash, -1, (mask + 1) * sizeof *hash);
+
+  if (old >= 0) {
+    prev = adfz_open (old);
+    if (prev && prev->track_size != z.track_size) {
+      adfz_close (prev);
+      prev = NULL;
+    }
+  }
+
+  pos = ADFZ_HEADER + z.n_tracks * ADFZ_ENTRY;
+  for (t = 0; t < z.n_tracks; t++) {
+    e = &z.table[t];
+    len = track_len (&z, t);
+    if (!pread_all (src, buf, len, (off_t) t * z.track_size))
+      goto out;
+
+    if (is_zero (buf, len))
+      continue;
+    e->crc = crc32 (0L, buf, len);
+
+    /* the same as an earlier track? */
+    for (h = e->crc & mask; hash[h] >= 0; h = (h + 1) & mask)
+      if (z.table[hash[h]].crc == e->crc && track_len (&z, hash[h]) == len
+	  && pread_all (src, other, len, (off_t) hash[h] * z.track_size)
+	  && memcmp (buf, other, len) == 0)
+	break;
+    if (hash[h] >= 0) {
+      *e = z.table[hash[h]];
+      continue;
+    }
+    hash[h] = t;
+
+    /* unchanged since the last time? */
+    if (prev && t < prev->n_tracks && prev->table[t].crc == e->crc
+	&& prev->table[t].length != 0 && track_len (prev, t) == len
+	&& read_track (prev, t, other) && memcmp (buf, other, len) == 0
+	&& pread_all (old, cbuf, prev->table[t].length, prev->table[t].offset)) {
+      e->length = prev->table[t].length;
+    } else {
+      deflateReset (&strm);
+      strm.next_in = buf;
+      strm.avail_in = len;
+      strm.next_out = cbuf;
+      strm.avail_out = deflateBound (&strm, z.track_size);
+      if (deflate (&strm, Z_FINISH) != Z_STREAM_END)
+	goto out;
+      e->length = strm.total_out;
+
+      /* incompressible, store it */
+      if (e->length >= len) {
+	memcpy (cbuf, buf, len);
+	e->length = len;
+      }
+    }
+
+    if (!pwrite_all (dst, cbuf, e->length, pos))
+      goto out;
+    e->offset = pos;
+    pos += e->length;
+  }
+
+  memcpy (hdr, ADFZ_MAGIC, 4);
+  put32 (hdr + 4, ADFZ_VERSION);
+  put32 (hdr + 8, z.track_size);
+  put32 (hdr + 12, z.n_tracks);
+  put64 (hdr + 16, z.size);
+  put64 (hdr + 24, 0);
+  for (t = 0; t < z.n_tracks; t++) {
+    put64 (table + t * ADFZ_ENTRY, z.table[t].offset);
+    put32 (table + t * ADFZ_ENTRY + 8, z.table[t].length);
+    put32 (table + t * ADFZ_ENTRY + 12, z.table[t].crc);
+  }
+
+  ret = pwrite_all (dst, hdr, sizeof hdr, 0)
+    && pwrite_all (dst, table, z.n_tracks * ADFZ_ENTRY, ADFZ_HEADER)
+    && ftruncate (dst, pos) == 0;
+
+ out:
+  deflateEnd (&strm);
+  if (prev)
+    adfz_close (prev);
+  free (hash);
+  free (z.table);
+  free (table);
+  free (buf);
+  free (other);
+  free (cbuf);
+  return ret;
+}
+
+/* unpacks the whole container in 'src' into 'dst' */
+int
+adfz_decompress (int src, int dst)
+{
+  struct adfz *z;
+  unsigned char *data;
+  long t;
+  int ret = 1;
+
+  z = adfz_open (src);
+  if (!z)
+    return 0;
+
+  for (t = 0; ret && t < z->n_tracks; t++) {
+    data = get_track (z, t);
+    ret = data && pwrite_all (dst, data, track_len (z, t),
+			      (off_t) t * z->track_size);
+  }
+
+  if (ret && ftruncate (dst, z->size) == -1)
+    ret = 0;
+
+  adfz_close (z);
+  return ret;
+}
+
+/* packs the raw image in 'src' into a new container 'name' */
+int
+adfz_write (int src, const char *name)
+{
+  int fd, ret;
+
+  fd = open (name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0)
+    return 0;
+
+  ret = adfz_compress (src, -1, fd);
+  if (close (fd) != 0)
+    ret = 0;
+  if (!ret)
+    unlink (name);
+
+  return ret;
+}
+
+static int
+adfz_dev_read (void *priv, off_t offset, size_t len, unsigned char *buf)
+{
+  return adfz_pread (priv, offset, len, buf);
+}
+
+static void
+adfz_dev_release (void *priv)
+{
+  struct adfz *z = priv;
+
+  close (z->fd);
+  adfz_close (z);
+}
+
+static const struct nativedev_ops adfz_ops = {
+  adfz_dev_read,
+  NULL,				/* read-only */
+  adfz_dev_release,
+  NULL
+};
+
+/* registers the container 'name' with the native device driver, so */
+/* it is read a track at a time instead of being unpacked            */
+int
+adfz_register (const char *name)
+{
+  struct adfz *z;
+  int fd;
+
+  fd = open (name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+
+  z = adfz_open (fd);
+  if (!z) {
+    close (fd);
+    return 0;
+  }
+
+  if (nativedev_fits (z->size) && nativedev_register (name, z->size, &adfz_ops, z))
+    return 1;
+
+  adfz_dev_release (z);
+  return 0;
+}
@@ -0,0 +1,33 @@
+#ifndef ADFTOOLS_ADFZ_H
+#define ADFTOOLS_ADFZ_H 1
+
+#include <sys/types.h>
+
+/* the seekable track-compressed image container. all numbers are
+ * little-endian:
+ *
+ *   header   "ADFZ", version (u32), track size (u32), number of tracks
+ *            (u32), image size (u64), reserved (u64)
+ *   table    per track: offset (u64), length (u32) and crc32 of the
+ *            uncompressed track (u32). a length of 0 is a track of zeros,
+ *            a length equal to the track size a stored track, anything
+ *            else raw deflate data. identical tracks share their frame
+ *   frames   the compressed tracks
+ */
+#define ADFZ_MAGIC   "ADFZ"
+#define ADFZ_SUFFIX  ".adfz"
+#define ADFZ_VERSION 1
+
+struct adfz;
+
+struct adfz *adfz_open (int fd);
+off_t adfz_size (struct adfz *z);
+int adfz_pread (struct adfz *z, off_t offset, size_t len, unsigned char *buf);
+void adfz_close (struct adfz *z);
+
+int adfz_compress (int src, int old, int dst);
+int adfz_decompress (int src, int dst);
+int adfz_write (int src, const char *name);
+int adfz_register (const char *name);
+
+#endif /* ADFTOOLS_ADFZ_H */
@@ -0,0 +1,411 @@
+/* bcache.c - block cache for images that are written to
+ *
+ * adftools - A complete package for maintaining image-files for the best
+ * Amiga-emulator out there: UAE - http://www.freiburg.linux.de/~uae/
+ *
+ * Copyright (C)2002-2015 Rikard Bosnjakovic <bos@hack.org>
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "bcache.h"
+#include "error.h"
+#include "journal.h"
+#include "nativedev.h"
+
+/* ADFLib reads and writes the root, directory and bitmap blocks over  */
+/* and over again while files are added or removed, 512 bytes at a     */
+/* time.  here they are kept in memory (least recently used blocks are */
+/* dropped first), and written only when the cache runs full or the    */
+/* image is released.  the dirty blocks are then sorted and every run  */
+/* of adjacent blocks goes out with a single pwritev().                */
+
+#define BLOCK_SIZE     512
+#define DEFAULT_KB     1024
+
+#ifndef IOV_MAX
+#define IOV_MAX        1024
+#endif
+
+struct block {
+  long n;
+  int dirty;
+  struct block *hnext;		/* hash chain */
+  struct block *prev, *next;	/* lru list, most recently used first */
+  unsigned char data[BLOCK_SIZE];
+};
+
+struct bcache {
+  int fd;
+  char *name;
+  off_t size;
+
+  struct block *blocks;
+  long n_blocks;
+  long n_used;
+  long n_dirty;
+  struct block **hash;
+  long n_hash;
+  struct block lru;		/* list head */
+  struct journal *journal;	/* where dirty blocks go, if not NULL */
+
+  unsigned long hits, misses, writes, runs;
+};
+
+static void
+lru_unlink (struct block *b)
+{
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+}
+
+static void
+lru_push (struct bcache *c, struct block *b)
+{
+  b->next = c->lru.next;
+  b->prev = &c->lru;
+  c->lru.next->prev = b;
+  c->lru.next = b;
+}
+
+static void
+hash_remove (struct bcache *c, struct block *b)
+{
+  struct block **p;
+
+  for (p = &c->hash[b->n % c->n_hash]; *p; p = &(*p)->hnext)
+    if (*p == b) {
+      *p = b->hnext;
+      break;
+    }
+}
+
+static struct block *
+lookup (struct bcache *c, long n)
+{
+  struct block *b;
+
+  for (b = c->hash[n % c->n_hash]; b; b = b->hnext)
+    if (b->n == n)
+      return b;
+
+  return NULL;
+}
+
+static int
+compare_blocks (const void *a, const void *b)
+{
+  long x = (*(struct block **) a)->n;
+  long y = (*(struct block **) b)->n;
+
+  return x < y ? -1 : x > y;
+}
+
+static int
+write_run (struct bcache *c, struct block **run, int n)
+{
+  struct iovec iov[n];
+  off_t offset = (off_t) run[0]->n * BLOCK_SIZE;
+  size_t len = (size_t) n * BLOCK_SIZE;
+  struct iovec *v = iov;
+  ssize_t done;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    iov[i].iov_base = run[i]->data;
+    iov[i].iov_len = BLOCK_SIZE;
+  }
+
+  /* restart short writes where they stopped */
+  while (len > 0) {
+    done = pwritev (c->fd, v, n, offset);
+    if (done < 0 && errno == EINTR)
+      continue;
+    if (done <= 0)
+      return 0;
+
+    c->writes++;
+    offset += done;
+    len -= done;
+    while (n > 0 && done >= v->iov_len) {
+      done -= v->iov_len;
+      v++;
+      n--;
+    }
+    if (n > 0) {
+      v->iov_base = (char *) v->iov_base + done;
+      v->iov_len -= done;
+    }
+  }
+
+  return 1;
+}
+
+/* writes all dirty blocks, in order */
+static int
+flush (struct bcache *c)
+{
+  struct block **dirty;
+  long i, j, n = 0;
+  int ret = 1;
+
+  if (c->n_dirty == 0)
+    return 1;
+
+  dirty = malloc (c->n_dirty * sizeof *dirty);
+  if (!dirty)
+    return 0;
+
+  for (i = 0; i < c->n_used; i++)
+    if (c->blocks[i].dirty)
+      dirty[n++] = &c->blocks[i];
+  qsort (dirty, n, sizeof *dirty, compare_blocks);
+
+  /* with a journal, nothing is written in place until the commit */
+  for (i = 0; c->journal && i < n; i++)
+    if (!journal_append (c->journal, dirty[i]->n, dirty[i]->data)) {
+      ret = 0;
+      break;
+    }
+
+  for (i = 0; !c->journal && i < n; i = j) {
+    for (j = i + 1; j < n && j - i < IOV_MAX; j++)
+      if (dirty[j]->n != dirty[j - 1]->n + 1)
+	break;
+
+    if (!write_run (c, dirty + i, j - i)) {
+      ret = 0;
+      break;
+    }
+    c->runs++;
+  }
+
+  if (ret) {
+    for (i = 0; i < n; i++)
+      dirty[i]->dirty = 0;
+    c->n_dirty = 0;
+  }
+
+  free (dirty);
+  return ret;
+}
+
+/* the cache entry for block 'n', read from the image if 'load' is set */
+static struct block *
+get_block (struct bcache *c, long n, int load)
+{
+  struct block *b;
+  ssize_t got;
+
+  b = lookup (c, n);
+  if (b) {
+    c->hits++;
+    lru_unlink (b);
+    lru_push (c, b);
+    return b;
+  }
+
+  c->misses++;
+  if (c->n_used < c->n_blocks)
+    b = &c->blocks[c->n_used++];
+  else {
+    /* reuse the least recently used block. if it was modified, */
+    /* everything modified goes out now in one go               */
+    b = c->lru.prev;
+    if (b->dirty && !flush (c))
+      return NULL;
+    lru_unlink (b);
+    if (b->n >= 0)
+      hash_remove (c, b);
+  }
+
+  b->n = n;
+  b->dirty = 0;
+  if (load) {
+    /* a block that was dropped from the cache may be in the journal */
+    got = c->journal ? journal_lookup (c->journal, n, b->data) : 0;
+    if (got > 0)
+      got = BLOCK_SIZE;
+    else if (got == 0)
+      do
+	got = pread (c->fd, b->data, BLOCK_SIZE, (off_t) n * BLOCK_SIZE);
+      while (got < 0 && errno == EINTR);
+    if (got < 0) {
+      /* not cached after all, it's the next one to be reused */
+      b->n = -1;
+      b->prev = c->lru.prev;
+      b->next = &c->lru;
+      c->lru.prev->next = b;
+      c->lru.prev = b;
+      return NULL;
+    }
+    if (got < BLOCK_SIZE)
+      memset (b->data + got, 0, BLOCK_SIZE - got);
+  }
+
+  b->hnext = c->hash[n % c->n_hash];
+  c->hash[n % c->n_hash] = b;
+  lru_push (c, b);
+
+  return b;
+}
+
+static int
+bcache_read (void *priv, off_t offset, size_t len, unsigned char *buf)
+{
+  struct bcache *c = priv;
+  struct block *b;
+  size_t skip, n;
+
+  while (len > 0) {
+    b = get_block (c, offset / BLOCK_SIZE, 1);
+    if (!b)
+      return 0;
+
+    skip = offset % BLOCK_SIZE;
+    n = BLOCK_SIZE - skip < len ? BLOCK_SIZE - skip : len;
+    memcpy (buf, b->data + skip, n);
+    buf += n;
+    offset += n;
+    len -= n;
+  }
+
+  return 1;
+}
+
+static int
+bcache_write (void *priv, off_t offset, size_t len, unsigned char *buf)
+{
+  struct bcache *c = priv;
+  struct block *b;
+  size_t skip, n;
+
+  while (len > 0) {
+    skip = offset % BLOCK_SIZE;
+    n = BLOCK_SIZE - skip < len ? BLOCK_SIZE - skip : len;
+
+    /* a whole block needs not be read first */
+    b = get_block (c, offset / BLOCK_SIZE, n < BLOCK_SIZE);
+    if (!b)
+      return 0;
+
+    memcpy (b->data + skip, buf, n);
+    if (!b->dirty) {
+      b->dirty = 1;
+      c->n_dirty++;
+    }
+    buf += n;
+    offset += n;
+    len -= n;
+  }
+
+  return 1;
+}
+
+static void
+bcache_release (void *priv)
+{
+  struct bcache *c = priv;
+
+  if (!flush (c) || (c->journal && !journal_commit (c->journal)))
+    error (0, "Can't write to '%s': %s", c->name, strerror (errno));
+  if (c->journal)
+    journal_close (c->journal);
+
+  if (getenv (STATS_ENV))
+    notify ("%s: block cache: %lu hits, %lu misses, "
+	    "%lu block runs written in %lu writes\n",
+	    c->name, c->hits, c->misses, c->runs, c->writes);
+
+  close (c->fd);
+  free (c->blocks);
+  free (c->hash);
+  free (c->name);
+  free (c);
+}
+
+static void
+bcache_prefetch (void *priv, off_t offset, size_t len)
+{
+  struct bcache *c = priv;
+
+  posix_fadvise (c->fd, offset, len, POSIX_FADV_WILLNEED);
+}
+
+static const struct nativedev_ops bcache_ops = {
+  bcache_read,
+  bcache_write,
+  bcache_release,
+  bcache_prefetch
+};
+
+/* registers the image 'name' to be read and written through a cache. */
+/* with 'journal' set, the writes go through a journal as well         */
+int
+bcache_register (const char *name, int journal)
+{
+  struct bcache *c;
+  struct stat st;
+  char *env;
+  long kb = DEFAULT_KB;
+  int err;
+
+  env = getenv (BCACHE_ENV);
+  if (env && *env)
+    kb = atol (env);
+  if (kb <= 0 && !journal)
+    return 0;		/* turned off */
+
+  c = calloc (1, sizeof *c);
+  if (!c)
+    return 0;
+
+  c->fd = open (name, O_RDWR | O_CLOEXEC);
+  if (c->fd < 0 || fstat (c->fd, &st) == -1 || !S_ISREG (st.st_mode))
+    goto fail;
+  if (!nativedev_fits (st.st_size)) {
+    errno = EFBIG;
+    goto fail;
+  }
+
+  c->size = st.st_size;
+  c->n_blocks = kb * 1024 / BLOCK_SIZE;
+  if (c->n_blocks < 16)
+    c->n_blocks = 16;
+  c->n_hash = c->n_blocks;
+  c->blocks = malloc (c->n_blocks * sizeof *c->blocks);
+  c->hash = calloc (c->n_hash, sizeof *c->hash);
+  c->name = strdup (name);
+  if (!c->blocks || !c->hash || !c->name)
+    goto fail;
+  c->lru.next = c->lru.prev = &c->lru;
+
+  if (journal) {
+    c->journal = journal_open (name, c->fd);
+    if (!c->journal)
+      goto fail;
+  }
+
+  if (nativedev_register (name, c->size, &bcache_ops, c))
+    return 1;
+
+ fail:
+  err = errno;
+  if (c->journal)
+    journal_close (c->journal);
+  if (c->fd >= 0)
+    close (c->fd);
+  free (c->blocks);
+  free (c->hash);
+  free (c->name);
+  free (c);
+  errno = err;
+  return 0;
+}
@@ -0,0 +1,12 @@
+#ifndef ADFTOOLS_BCACHE_H
+#define ADFTOOLS_BCACHE_H 1
+
+/* name of the environment variable with the size of the cache (KB) */
+#define BCACHE_ENV "ADFTOOLS_BCACHE"
+
+/* name of the environment variable that asks for statistics */
+#define STATS_ENV "ADFTOOLS_STATS"
+
+int bcache_register (const char *name, int journal);
+
+#endif /* ADFTOOLS_BCACHE_H */
@@ -0,0 +1,440 @@
+/* journal.c - write-ahead journal for images that are written to
+ *
+ * adftools - A complete package for maintaining image-files for the best
+ * Amiga-emulator out there: UAE - http://www.freiburg.linux.de/~uae/
+ *
+ * Copyright (C)2002-2015 Rikard Bosnjakovic <bos@hack.org>
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "journal.h"
+
+/* a tool that dies halfway leaves an image with half of its blocks     */
+/* written, typically a bitmap that doesn't match the directories.      */
+/* with the journal, no block of the image is written during a session: */
+/* they are appended to "<image>.journal" instead.  at the end a commit */
+/* record goes after them and the journal is synced, and only then are  */
+/* the blocks written in place, the image synced and the journal        */
+/* removed.  a journal that is found when the image is mounted next is  */
+/* either complete, and written again, or not, and thrown away; in both */
+/* cases the image is consistent.                                       */
+/*                                                                      */
+/* the journal is "ADFJRNL1" and eight reserved bytes, then records of  */
+/* a block number (u64) and the 512 bytes of the block, then the commit */
+/* record: ~0 (u64), the number of records (u64), the crc32 of all the  */
+/* records (u32) and four zero bytes. numbers are little-endian         */
+
+#define JOURNAL_MAGIC "ADFJRNL1"
+#define HEADER_SIZE   16
+#define BLOCK_SIZE    512
+#define RECORD_SIZE   (8 + BLOCK_SIZE)
+#define COMMIT_SIZE   24
+#define COMMIT_MARK   UINT64_MAX
+
+struct journal {
+  int fd;
+  int image_fd;
+  char name[PATH_MAX];
+  off_t end;			/* where the next record goes */
+  uint64_t n_records;
+  uLong crc;
+  int sealed;			/* the commit record is written */
+
+  /* block number -> offset of its latest record, open addressing */
+  long *keys;
+  off_t *offsets;
+  long n_slots;
+  long n_used;
+};
+
+static uint64_t
+get64 (const unsigned char *p)
+{
+  uint64_t v = 0;
+  int i;
+
+  for (i = 7; i >= 0; i--)
+    v = v << 8 | p[i];
+
+  return v;
+}
+
+static void
+put64 (unsigned char *p, uint64_t v)
+{
+  int i;
+
+  for (i = 0; i < 8; i++, v >>= 8)
+    p[i] = v;
+}
+
+static int
+pread_all (int fd, void *buf, size_t len, off_t offset)
+{
+  unsigned char *p = buf;
+  ssize_t n;
+
+  while (len > 0) {
+    n = pread (fd, p, len, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    p += n;
+    offset += n;
+    len -= n;
+  }
+
+  return 1;
+}
+
+static int
+pwrite_all (int fd, const void *buf, size_t len, off_t offset)
+{
+  const unsigned char *p = buf;
+  ssize_t n;
+
+  while (len > 0) {
+    n = pwrite (fd, p, len, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    p += n;
+    offset += n;
+    len -= n;
+  }
+
+  return 1;
+}
+
+/* makes the creation or removal of the file 'name' stick */
+static int
+sync_dir (const char *name)
+{
+  char path[PATH_MAX];
+  int fd, ret;
+
+  snprintf (path, sizeof path, "%s", name);
+  fd = open (dirname (path), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+  ret = fsync (fd) == 0;
+  close (fd);
+
+  return ret;
+}
+
+/* the slot of block 'n', or the empty one where it would go */
+static long
+find_slot (struct journal *j, long n)
+{
+  long h = (unsigned long) n * 2654435761UL % j->n_slots;
+
+  while (j->keys[h] >= 0 && j->keys[h] != n)
+    h = (h + 1) % j->n_slots;
+
+  return h;
+}
+
+static int
+remember (struct journal *j, long n, off_t offset)
+{
+  long *keys, h, i;
+  off_t *offsets;
+  long n_slots;
+
+  if (2 * (j->n_used + 1) > j->n_slots) {
+    n_slots = j->n_slots ? 2 * j->n_slots : 1024;
+    keys = malloc (n_slots * sizeof *keys);
+    offsets = malloc (n_slots * sizeof *offsets);
+    if (!keys || !offsets) {
+      free (keys);
+      free (offsets);
+      return 0;
+    }
+    memset (keys, -1, n_slots * sizeof *keys);
+
+    /* rehash */
+    for (i = 0; i < j->n_slots; i++)
+      if (j->keys[i] >= 0) {
+	for (h = (unsigned long) j->keys[i] * 2654435761UL % n_slots;
+	     keys[h] >= 0; h = (h + 1) % n_slots)
+	  ;
+	keys[h] = j->keys[i];
+	offsets[h] = j->offsets[i];
+      }
+
+    free (j->keys);
+    free (j->offsets);
+    j->keys = keys;
+    j->offsets = offsets;
+    j->n_slots = n_slots;
+  }
+
+  h = find_slot (j, n);
+  if (j->keys[h] < 0) {
+    j->keys[h] = n;
+    j->n_used++;
+  }
+  j->offsets[h] = offset;
+
+  return 1;
+}
+
+/* starts a new, empty journal for 'image', open as 'image_fd' */
+struct journal *
+journal_open (const char *image, int image_fd)
+{
+  unsigned char hdr[HEADER_SIZE];
+  struct journal *j;
+
+  j = calloc (1, sizeof *j);
+  if (!j)
+    return NULL;
+
+  snprintf (j->name, sizeof j->name, "%s%s", image, JOURNAL_SUFFIX);
+  j->fd = open (j->name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (j->fd < 0) {
+    free (j);
+    return NULL;
+  }
+
+  /* the entry has to be on disk before any block is written in place, */
+  /* or a crash could leave an image without the journal to finish it  */
+  memset (hdr, 0, sizeof hdr);
+  memcpy (hdr, JOURNAL_MAGIC, 8);
+  if (!pwrite_all (j->fd, hdr, sizeof hdr, 0) || !sync_dir (j->name)) {
+    journal_close (j);
+    return NULL;
+  }
+
+  j->image_fd = image_fd;
+  j->end = HEADER_SIZE;
+  j->crc = crc32 (0L, Z_NULL, 0);
+
+  return j;
+}
+
+/* appends block 'n' to the journal. nothing is synced yet */
+int
+journal_append (struct journal *j, long n, const unsigned char *data)
+{
+  unsigned char record[RECORD_SIZE];
+
+  put64 (record, n);
+  memcpy (record + 8, data, BLOCK_SIZE);
+  if (!pwrite_all (j->fd, record, sizeof record, j->end)
+      || !remember (j, n, j->end))
+    return 0;
+
+  j->crc = crc32 (j->crc, record, sizeof record);
+  j->n_records++;
+  j->end += RECORD_SIZE;
+
+  return 1;
+}
+
+/* the latest version of block 'n' in the journal. returns 0 if it */
+/* isn't there, -1 on errors                                       */
+int
+journal_lookup (struct journal *j, long n, unsigned char *data)
+{
+  long h;
+
+  if (!j->n_slots)
+    return 0;
+
+  h = find_slot (j, n);
+  if (j->keys[h] < 0)
+    return 0;
+
+  return pread_all (j->fd, data, BLOCK_SIZE, j->offsets[h] + 8) ? 1 : -1;
+}
+
+static int
+compare_offsets (const void *a, const void *b)
+{
+  off_t x = *(const off_t *) a;
+  off_t y = *(const off_t *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* writes the latest version of every block in the journal into the */
+/* image, in the order of the journal                               */
+static int
+apply (int fd, int image_fd, off_t *offsets, long n)
+{
+  unsigned char record[RECORD_SIZE];
+  long i;
+
+  qsort (offsets, n, sizeof *offsets, compare_offsets);
+  for (i = 0; i < n; i++)
+    if (!pread_all (fd, record, sizeof record, offsets[i])
+	|| !pwrite_all (image_fd, record + 8, BLOCK_SIZE,
+			(off_t) get64 (record) * BLOCK_SIZE))
+      return 0;
+
+  return fsync (image_fd) == 0;
+}
+
+/* seals the journal, writes its blocks into the image and removes it */
+int
+journal_commit (struct journal *j)
+{
+  unsigned char commit[COMMIT_SIZE];
+  off_t *offsets;
+  long i, n = 0;
+  int ret;
+
+  if (j->n_records == 0) {
+    unlink (j->name);
+    j->sealed = 1;
+    return 1;
+  }
+
+  memset (commit, 0, sizeof commit);
+  put64 (commit, COMMIT_MARK);
+  put64 (commit + 8, j->n_records);
+  put64 (commit + 16, j->crc);
+  if (!pwrite_all (j->fd, commit, sizeof commit, j->end)
+      || fsync (j->fd) != 0)
+    return 0;
+  j->sealed = 1;
+
+  offsets = malloc (j->n_used * sizeof *offsets + 1);
+  if (!offsets)
+    return 0;
+  for (i = 0; i < j->n_slots; i++)
+    if (j->keys[i] >= 0)
+      offsets[n++] = j->offsets[i];
+
+  ret = apply (j->fd, j->image_fd, offsets, n);
+  free (offsets);
+
+  /* a journal that's left behind is applied again on the next mount */
+  if (ret)
+    ret = unlink (j->name) == 0 && sync_dir (j->name);
+
+  return ret;
+}
+
+/* forgets the journal. if it wasn't committed, the image is untouched */
+/* and the journal is of no use. a committed one is removed by the     */
+/* commit once it's written in place, or else is needed by the replay  */
+void
+journal_close (struct journal *j)
+{
+  if (!j->sealed)
+    unlink (j->name);
+
+  close (j->fd);
+  free (j->keys);
+  free (j->offsets);
+  free (j);
+}
+
+/* whether a crashed session left a journal behind for 'image' */
+int
+journal_pending (const char *image)
+{
+  unsigned char magic[8];
+  char name[PATH_MAX];
+  int fd, ret;
+
+  snprintf (name, sizeof name, "%s%s", image, JOURNAL_SUFFIX);
+  fd = open (name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+  ret = pread_all (fd, magic, sizeof magic, 0)
+    && memcmp (magic, JOURNAL_MAGIC, 8) == 0;
+  close (fd);
+
+  return ret;
+}
+
+/* finishes or throws away the journal a crashed session left behind. */
+/* the image has to be locked exclusively. returns 0 if the journal   */
+/* can't be dealt with                                                */
+int
+journal_replay (const char *image)
+{
+  unsigned char record[RECORD_SIZE];
+  char name[PATH_MAX];
+  struct journal j;
+  uLong crc;
+  uint64_t n;
+  off_t pos;
+  int image_fd, ret;
+
+  snprintf (name, sizeof name, "%s%s", image, JOURNAL_SUFFIX);
+  memset (&j, 0, sizeof j);
+  j.fd = open (name, O_RDONLY | O_CLOEXEC);
+  if (j.fd < 0)
+    return errno == ENOENT;
+
+  if (!pread_all (j.fd, record, HEADER_SIZE, 0)
+      || memcmp (record, JOURNAL_MAGIC, 8) != 0) {
+    /* not ours, leave it alone */
+    close (j.fd);
+    return 1;
+  }
+
+  /* look for the commit record, and check it */
+  crc = crc32 (0L, Z_NULL, 0);
+  for (pos = HEADER_SIZE, n = 0; ; pos += RECORD_SIZE, n++) {
+    if (!pread_all (j.fd, record, 8, pos))
+      break;
+    if (get64 (record) == COMMIT_MARK)
+      break;
+    if (!pread_all (j.fd, record, RECORD_SIZE, pos) || !remember (&j, get64 (record), pos)) {
+      pos = -1;
+      break;
+    }
+    crc = crc32 (crc, record, RECORD_SIZE);
+  }
+
+  ret = 1;
+  if (pos >= 0 && pread_all (j.fd, record, COMMIT_SIZE, pos)
+      && get64 (record) == COMMIT_MARK && get64 (record + 8) == n
+      && get64 (record + 16) == crc && n > 0) {
+    off_t *offsets;
+    long i, k = 0;
+
+    /* committed, but maybe not (all) written in place */
+    image_fd = open (image, O_WRONLY | O_CLOEXEC);
+    offsets = malloc (j.n_used * sizeof *offsets + 1);
+    if (image_fd < 0 || !offsets)
+      ret = 0;
+    else {
+      for (i = 0; i < j.n_slots; i++)
+	if (j.keys[i] >= 0)
+	  offsets[k++] = j.offsets[i];
+      ret = apply (j.fd, image_fd, offsets, k);
+    }
+    free (offsets);
+    if (image_fd >= 0)
+      close (image_fd);
+  }
+
+  /* applied, or never committed: either way it's done with */
+  if (ret)
+    ret = unlink (name) == 0 && sync_dir (name);
+
+  close (j.fd);
+  free (j.keys);
+  free (j.offsets);
+  return ret;
+}
@@ -0,0 +1,20 @@
+#ifndef ADFTOOLS_JOURNAL_H
+#define ADFTOOLS_JOURNAL_H 1
+
+/* name of the environment variable that turns journaling on */
+#define JOURNAL_ENV "ADFTOOLS_JOURNAL"
+
+/* the journal of "foo.adf" is "foo.adf.journal" */
+#define JOURNAL_SUFFIX ".journal"
+
+struct journal;
+
+struct journal *journal_open (const char *image, int image_fd);
+int journal_append (struct journal *j, long n, const unsigned char *data);
+int journal_lookup (struct journal *j, long n, unsigned char *data);
+int journal_commit (struct journal *j);
+void journal_close (struct journal *j);
+int journal_pending (const char *image);
+int journal_replay (const char *image);
+
+#endif /* ADFTOOLS_JOURNAL_H */
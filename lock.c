@@ -0,0 +1,136 @@
+/* lock.c - shared and exclusive locks on images
+ *
+ * adftools - A complete package for maintaining image-files for the best
+ * Amiga-emulator out there: UAE - http://www.freiburg.linux.de/~uae/
+ *
+ * Copyright (C)2002-2015 Rikard Bosnjakovic <bos@hack.org>
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lock.h"
+
+/* any number of tools may read an image at the same time, but one    */
+/* that writes to it has it to itself.  the lock is taken on an open  */
+/* file description (OFD lock) of its own, so it isn't lost when the  */
+/* image is opened and closed again by zfile or ADFLib, as an ordinary */
+/* fcntl lock would be.  flock() does the same where OFD locks aren't */
+/* known.  the locks are held until the tool is done with the images, */
+/* which includes writing back compressed ones.  those are replaced by */
+/* a new file, so a lock that was waited for may be on a file that's   */
+/* gone: it's taken again on the one the name leads to now             */
+
+struct lock {
+  int fd;
+  struct lock *next;
+};
+
+static struct lock *locks;
+
+/* tries to take the lock once. returns 1 if it's taken, 0 if someone */
+/* else has it and -1 on errors                                       */
+static int
+try_lock (int fd, int exclusive, int wait)
+{
+#ifdef F_OFD_SETLK
+  struct flock fl = {0};
+
+  fl.l_type = exclusive ? F_WRLCK : F_RDLCK;
+  fl.l_whence = SEEK_SET;
+  if (fcntl (fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &fl) == 0)
+    return 1;
+  if (errno == EAGAIN || errno == EACCES)
+    return 0;
+  if (errno != EINVAL)
+    return -1;
+#endif
+
+  /* no OFD locks in this kernel */
+  if (flock (fd, (exclusive ? LOCK_EX : LOCK_SH) | (wait ? 0 : LOCK_NB)) == 0)
+    return 1;
+
+  return errno == EWOULDBLOCK ? 0 : -1;
+}
+
+/* locks the image 'name', shared or exclusive. how long to wait for */
+/* others to let go of it is taken from LOCK_WAIT_ENV, in seconds: by */
+/* default it isn't waited for at all, and if it's negative forever. */
+/* returns 0 if the lock can't be had, with errno set                */
+int
+lock_image (const char *name, int exclusive)
+{
+  struct timespec start, now, pause = {0, 10000000};
+  struct stat locked, named;
+  struct lock *lock;
+  char *env;
+  double wait = 0;
+  int fd, ret;
+
+  env = getenv (LOCK_WAIT_ENV);
+  if (env)
+    wait = atof (env);
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (;;) {
+    fd = open (name, (exclusive ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (fd < 0)
+      return 0;
+
+    /* poll until the time is up, backing off up to 1/4 second */
+    while ((ret = try_lock (fd, exclusive, wait < 0)) == 0) {
+      clock_gettime (CLOCK_MONOTONIC, &now);
+      if (now.tv_sec - start.tv_sec + (now.tv_nsec - start.tv_nsec) / 1e9 >= wait)
+	break;
+      nanosleep (&pause, NULL);
+      if (pause.tv_nsec < 250000000)
+	pause.tv_nsec *= 2;
+    }
+
+    /* still the file of that name? */
+    if (ret <= 0 || (fstat (fd, &locked) == 0 && stat (name, &named) == 0
+		     && locked.st_dev == named.st_dev
+		     && locked.st_ino == named.st_ino))
+      break;
+    close (fd);
+  }
+
+  /* some file systems don't do locks, use them unlocked then */
+  if (ret < 0 && (errno == ENOLCK || errno == EOPNOTSUPP)) {
+    close (fd);
+    return 1;
+  }
+
+  lock = ret > 0 ? malloc (sizeof *lock) : NULL;
+  if (!lock) {
+    if (ret == 0)
+      errno = EWOULDBLOCK;
+    close (fd);
+    return 0;
+  }
+
+  lock->fd = fd;
+  lock->next = locks;
+  locks = lock;
+
+  return 1;
+}
+
+/* lets go of all the images */
+void
+lock_release_all (void)
+{
+  struct lock *lock;
+
+  while (locks) {
+    lock = locks;
+    locks = lock->next;
+    close (lock->fd);
+    free (lock);
+  }
+}
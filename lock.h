@@ -0,0 +1,10 @@
+#ifndef ADFTOOLS_LOCK_H
+#define ADFTOOLS_LOCK_H 1
+
+/* name of the environment variable with the time to wait for a lock */
+#define LOCK_WAIT_ENV "ADFTOOLS_LOCK_WAIT"
+
+int lock_image (const char *name, int exclusive);
+void lock_release_all (void);
+
+#endif /* ADFTOOLS_LOCK_H */
@@ -12,9 +12,16 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "adfz.h"
+#include "bcache.h"
 #include "error.h"
+#include "journal.h"
+#include "lock.h"
 #include "misc.h"
+#include "nativedev.h"
+#include "overlay.h"
 #include "zfile.h"
+#include "zindex.h"
 
 /* "12345678" -> 1, "12354foo1234" -> 0 */
 int
@@ -135,22 +142,90 @@ get_adf_dostype (char dostype)
   return "ApanAP-FS";
 }
 
+/* the file to read for 'filename', "-" is standard input */
+static char *
+image_file (char *filename)
+{
+  if (strcmp (filename, "-") == 0)
+    return (char *) zfile_stdin();
+
+  return filename;
+}
+
 /* mounts an adf-image */
 int
 mount_adf (char *filename, struct Device **dev, struct Volume **vol, int rw)
 {
   char *errmsg = "Can't mount the device '%s' (perhaps not a DOS-disk or adf-file)";
+  char *image, *name;
+  int overlay, exclusive, journal;
+
+  image = image_file (filename);
+  if (!image) {
+    notify ("Can't read the image from standard input: %s.\n", strerror (errno));
+    return 0;
+  }
 
-  /* check existence and readability of the file */
-  if (access (filename, F_OK | R_OK) == -1) {
+  if (image != filename) {
+    /* nothing to check, but nowhere to write back to either */
+    if (rw == READ_WRITE) {
+      notify ("Can't write to an image on standard input.\n");
+      return 0;
+    }
+  } else if (access (filename, F_OK | R_OK) == -1) {
+    /* check existence and readability of the file */
     notify ("Can't access '%s': %s.\n", filename, strerror (errno));
     return 0;
+  } else if (!lock_image (filename, exclusive = rw == READ_WRITE || journal_pending (filename))) {
+    /* shared with other readers, or all ours to write to. a journal */
+    /* is written back, even when the image is only to be read      */
+    if (errno == EWOULDBLOCK)
+      notify ("'%s' is in use by another tool.\n", filename);
+    else
+      notify ("Can't lock '%s': %s.\n", filename, strerror (errno));
+    return 0;
+  } else if (!exclusive && journal_pending (filename)) {
+    /* left behind since we looked, by a tool we didn't wait for */
+    notify ("'%s' has an unfinished journal.\n", filename);
+    return 0;
+  } else if (exclusive && !journal_replay (filename)) {
+    /* finish the session that left the journal behind */
+    notify ("Can't write the journal of '%s' back: %s.\n", filename, strerror (errno));
+    return 0;
   }
 
-  if (rw == READ_WRITE)
-    *dev = adfMountDev (n_zfile_open(filename, "rw", 1), rw);
-  else
-    *dev = adfMountDev (n_zfile_open(filename, "r", 0), rw);
+  overlay = overlay_register (image, rw == READ_WRITE);
+  if (overlay < 0) {
+    notify ("Can't open the overlay '%s': %s.\n", filename, strerror (errno));
+    return 0;
+  }
+
+  if (overlay)
+    /* the base image with the blocks of the delta on top */
+    *dev = adfMountDev (image, rw);
+  else if (rw == READ_WRITE) {
+    /* written through a block cache, unless it's turned off. a     */
+    /* compressed image is replaced in one go anyway, only a plain */
+    /* one needs the journal                                       */
+    name = n_zfile_open(image, "rw", 1);
+    journal = name && getenv (JOURNAL_ENV) && strcmp (name, image) == 0;
+    if (name && !bcache_register (name, journal) && journal) {
+      /* asked for, so not written without it */
+      notify ("Can't journal '%s': %s.\n", filename, strerror (errno));
+      return 0;
+    }
+    *dev = name ? adfMountDev (name, rw) : NULL;
+  } else if (zindex_register (image) || adfz_register (image))
+    /* indexed gzip or adfz, read straight from the compressed file */
+    *dev = adfMountDev (image, rw);
+  else {
+    /* anything else is read from a mapping of the (unpacked) image, */
+    /* or by ADFLib itself if it can't be mapped                     */
+    name = n_zfile_open(image, "r", 0);
+    if (name)
+      nativedev_map (name);
+    *dev = name ? adfMountDev (name, rw) : NULL;
+  }
 
   if (!*dev) {
     error (0, errmsg, filename);
@@ -211,14 +286,22 @@ init_adflib (void)
 
   /* yes, we want to use directory caching */
   adfChgEnvProp (PR_USEDIRC, (void *)&true);
+
+  /* serve registered images through our own device driver */
+  nativedev_install();
 }
 
 /* shut down the adflib */
 void
 cleanup_adflib (void)
 {
+  /* write back cached blocks before the images are packed */
+  nativedev_exit();
   adfEnvCleanUp();
   zfile_exit();
+
+  /* only now are the images written back */
+  lock_release_all();
 }
 
 /* puts access bits in a readable string */
@@ -283,37 +366,25 @@ allocate_bootblock_buf (void)
   return bootblock;
 }
 
-/* read bootblock bytes into a buffer */
+/* read bootblock bytes into a buffer. only the start of a compressed */
+/* image is unpacked                                                   */
 unsigned char *
 read_bootblock (char *filename)
 {
   unsigned char *bootblock;
-  FILE *file;
+  char *image = image_file (filename);
 
   bootblock = allocate_bootblock_buf();
-  if (!bootblock)
-    return NULL;
-
-  memset (bootblock, 0, BOOTBLOCK_SIZE);
-  file = f_zfile_open (filename, "r", 0);
-  if (!file) {
+  if (!bootblock || !image) {
     free (bootblock);
     return NULL;
   }
 
-  if (fread (bootblock, BOOTBLOCK_SIZE, 1, file) != 1) {
-    /* error? */
-    if (ferror (file)) {
-      /* yes */
-      free (bootblock);
-      fclose (file);
-      return NULL;
-    } else if (!feof (file))
-      /* no error, but not end of file either. bloody hell! */
-      return NULL;
+  /* a short file leaves the rest of the buffer zeroed */
+  if (zfile_read_prefix (image, bootblock, BOOTBLOCK_SIZE) < 0) {
+    free (bootblock);
+    return NULL;
   }
 
-  /* all went fine */
-  fclose (file);
   return bootblock;
 }
@@ -22,6 +22,7 @@
 #define ADF_FTW_D   2 /* directory */
 #define ADF_FTW_DNR 3 /* unreadable directory */
 #define ADF_FTW_NS  4 /* file that we can't stat */
+#define ADF_FTW_DP  5 /* directory, after its contents */
 
 #define READ_ONLY 1
 #define READ_WRITE 0
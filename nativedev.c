@@ -0,0 +1,449 @@
+/* nativedev.c - native device driver for ADFLib
+ *
+ * adftools - A complete package for maintaining image-files for the best
+ * Amiga-emulator out there: UAE - http://www.freiburg.linux.de/~uae/
+ *
+ * Copyright (C)2002-2015 Rikard Bosnjakovic <bos@hack.org>
+ */
+#include <adflib.h>
+#include <adf_nativ.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "nativedev.h"
+
+/* ADFLib reads and writes an image either through its dump device      */
+/* (fseek() and fread()/fwrite() on the file) or through the functions  */
+/* of the native device driver in adfEnv.nativeFct, which are meant for */
+/* real drives.  we replace the latter with our own: an image that is   */
+/* registered here under a name is served by the given operations when  */
+/* that name is passed to adfMountDev(), everything else still goes     */
+/* through the dump device.                                             */
+
+/* needed to get hold of adfEnv.nativeFct */
+ENV_DECLARATION;
+
+struct nativedev {
+  struct nativedev *next;
+  char *name;
+  off_t size;
+  int mounted;
+  const struct nativedev_ops *ops;
+  void *priv;
+};
+
+/* images registered, but not (yet) released by adfUnMountDev() */
+static struct nativedev *devices;
+
+static BOOL
+nativedev_is_native (char *name)
+{
+  struct nativedev *d;
+
+  for (d = devices; d; d = d->next)
+    if (!d->mounted && strcmp (d->name, name) == 0)
+      return TRUE;
+
+  return FALSE;
+}
+
+static RETCODE
+nativedev_init (struct Device *dev, char *name, BOOL ro)
+{
+  struct nativedev *d;
+
+  for (d = devices; d; d = d->next)
+    if (!d->mounted && strcmp (d->name, name) == 0)
+      break;
+
+  if (!d || (!ro && !d->ops->write))
+    return RC_ERROR;
+
+  d->mounted = 1;
+  dev->nativeDev = d;
+  dev->size = d->size;
+
+  return RC_OK;
+}
+
+static unsigned long
+get_long (const unsigned char *p)
+{
+  return (unsigned long) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static int
+compare_longs (const void *a, const void *b)
+{
+  long x = *(const long *) a;
+  long y = *(const long *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* a directory is usually read entry by entry right after its own block, */
+/* and every entry is followed by the next one on its hash chain. the    */
+/* blocks a header block points to are handed to the backend as a hint,  */
+/* merged into runs, so they are on their way before ADFLib asks for     */
+/* them one at a time                                                    */
+static void
+readahead (struct nativedev *d, long n, const unsigned char *buf)
+{
+  long blocks[HT_SIZE + 1];
+  long sec_type, b;
+  int i, j, count = 0;
+
+  if (get_long (buf) != T_HEADER)
+    return;
+
+  sec_type = (long) get_long (buf + 508);
+  if (sec_type == ST_ROOT || sec_type == ST_DIR)
+    for (i = 0; i < HT_SIZE; i++)
+      blocks[count++] = get_long (buf + 24 + 4 * i);	/* hash table */
+  blocks[count++] = get_long (buf + 496);		/* hash chain */
+
+  for (i = j = 0; i < count; i++) {
+    b = blocks[i];
+    if (b > 0 && b != n && (off_t) (b + 1) * LOGICAL_BLOCK_SIZE <= d->size)
+      blocks[j++] = b;
+  }
+  count = j;
+  qsort (blocks, count, sizeof *blocks, compare_longs);
+
+  for (i = 0; i < count; i = j) {
+    for (j = i + 1; j < count && blocks[j] <= blocks[j - 1] + 1; j++)
+      ;
+    d->ops->prefetch (d->priv, (off_t) blocks[i] * LOGICAL_BLOCK_SIZE,
+		      (size_t) (blocks[j - 1] - blocks[i] + 1) * LOGICAL_BLOCK_SIZE);
+  }
+}
+
+static RETCODE
+nativedev_read (struct Device *dev, long n, int size, unsigned char *buf)
+{
+  struct nativedev *d = dev->nativeDev;
+
+  if (!d->ops->read (d->priv, (off_t) n * LOGICAL_BLOCK_SIZE, size, buf))
+    return RC_ERROR;
+
+  if (d->ops->prefetch && size == LOGICAL_BLOCK_SIZE)
+    readahead (d, n, buf);
+
+  return RC_OK;
+}
+
+static RETCODE
+nativedev_write (struct Device *dev, long n, int size, unsigned char *buf)
+{
+  struct nativedev *d = dev->nativeDev;
+
+  if (!d->ops->write
+      || !d->ops->write (d->priv, (off_t) n * LOGICAL_BLOCK_SIZE, size, buf))
+    return RC_ERROR;
+
+  return RC_OK;
+}
+
+static RETCODE
+nativedev_release (struct Device *dev)
+{
+  struct nativedev *d = dev->nativeDev;
+  struct nativedev **p;
+
+  for (p = &devices; *p; p = &(*p)->next)
+    if (*p == d) {
+      *p = d->next;
+      break;
+    }
+
+  if (d->ops->release)
+    d->ops->release (d->priv);
+
+  free (d->name);
+  free (d);
+  dev->nativeDev = NULL;
+
+  return RC_OK;
+}
+
+/* hooks our driver into ADFLib, must be called after adfEnvInitDefault() */
+void
+nativedev_install (void)
+{
+  struct nativeFunctions *fct = adfEnv.nativeFct;
+
+  fct->adfInitDevice = nativedev_init;
+  fct->adfNativeReadSector = nativedev_read;
+  fct->adfNativeWriteSector = nativedev_write;
+  fct->adfIsDevNative = nativedev_is_native;
+  fct->adfReleaseDevice = nativedev_release;
+}
+
+/* releases all images, mounted or not. the tools never unmount their */
+/* devices, and images with a cache have to be written back           */
+void
+nativedev_exit (void)
+{
+  struct nativedev *d;
+
+  while ((d = devices)) {
+    devices = d->next;
+
+    if (d->ops->release)
+      d->ops->release (d->priv);
+    free (d->name);
+    free (d);
+  }
+}
+
+/* whether an image of 'size' bytes can be served by us. ADFLib takes */
+/* only floppies from a native device: it reads the first block of a  */
+/* hardfile through its dump device, and won't look for a hardfile    */
+/* without partitions on a native one. those are left to ADFLib       */
+int
+nativedev_fits (off_t size)
+{
+  return size == 80 * 2 * 11 * LOGICAL_BLOCK_SIZE
+    || size == 80 * 2 * 22 * LOGICAL_BLOCK_SIZE;
+}
+
+/* makes adfMountDev(name) use 'ops' for an image of 'size' bytes, one */
+/* that nativedev_fits(). the image is released (ops->release) when    */
+/* the device is unmounted                                             */
+int
+nativedev_register (const char *name, off_t size,
+		    const struct nativedev_ops *ops, void *priv)
+{
+  struct nativedev *d;
+
+  d = malloc (sizeof *d);
+  if (!d)
+    return 0;
+
+  d->name = strdup (name);
+  if (!d->name) {
+    free (d);
+    return 0;
+  }
+
+  d->size = size;
+  d->mounted = 0;
+  d->ops = ops;
+  d->priv = priv;
+  d->next = devices;
+  devices = d;
+
+  return 1;
+}
+
+/* an image mapped into memory */
+struct mapping {
+  unsigned char *data;
+  size_t size;
+  int fd;			/* for nativedev_source() */
+};
+
+static int
+map_read (void *priv, off_t offset, size_t len, unsigned char *buf)
+{
+  struct mapping *m = priv;
+
+  if (offset < 0 || offset + len > m->size)
+    return 0;
+
+  memcpy (buf, m->data + offset, len);
+  return 1;
+}
+
+static void
+map_release (void *priv)
+{
+  struct mapping *m = priv;
+
+  munmap (m->data, m->size);
+  close (m->fd);
+  free (m);
+}
+
+static void
+map_prefetch (void *priv, off_t offset, size_t len)
+{
+  struct mapping *m = priv;
+  long page = sysconf (_SC_PAGESIZE);
+  off_t start = offset - offset % page;
+
+  madvise (m->data + start, len + (offset - start), MADV_WILLNEED);
+}
+
+static const struct nativedev_ops map_ops = {
+  map_read,
+  NULL,				/* read-only */
+  map_release,
+  map_prefetch
+};
+
+/* registers the (uncompressed) image 'name' to be read from a mapping */
+/* of the file, which saves ADFLib's fseek() and fread() per block     */
+int
+nativedev_map (const char *name)
+{
+  struct mapping *m;
+  struct stat st;
+  int fd;
+
+  fd = open (name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+
+  if (fstat (fd, &st) == -1 || !S_ISREG (st.st_mode) || !nativedev_fits (st.st_size)) {
+    close (fd);
+    return 0;
+  }
+
+  m = malloc (sizeof *m);
+  if (!m) {
+    close (fd);
+    return 0;
+  }
+
+  m->size = st.st_size;
+  m->fd = fd;
+  m->data = mmap (NULL, m->size, PROT_READ, MAP_SHARED, fd, 0);
+  if (m->data == MAP_FAILED) {
+    close (fd);
+    free (m);
+    return 0;
+  }
+
+  if (nativedev_register (name, m->size, &map_ops, m))
+    return 1;
+
+  map_release (m);
+  return 0;
+}
+
+/* writes the 'count' whole blocks from block 'n' of a mounted 'dev' */
+/* in one go, if it's ours. returns 0 if it isn't, or on errors       */
+int
+nativedev_write_blocks (struct Device *dev, long n, long count,
+			unsigned char *buf)
+{
+  struct nativedev *d = dev->nativeDev;
+
+  if (!dev->isNativeDev || !d || !d->ops->write)
+    return 0;
+
+  return d->ops->write (d->priv, (off_t) n * LOGICAL_BLOCK_SIZE,
+			(size_t) count * LOGICAL_BLOCK_SIZE, buf);
+}
+
+/* the file and the mapping a mounted 'dev' is read from, if it's a */
+/* plain image registered with nativedev_map(). they stay valid     */
+/* until the device is released                                     */
+int
+nativedev_source (struct Device *dev, int *fd, const unsigned char **data,
+		  size_t *size)
+{
+  struct nativedev *d = dev->nativeDev;
+  struct mapping *m;
+
+  if (!dev->isNativeDev || !d || d->ops != &map_ops)
+    return 0;
+
+  m = d->priv;
+  *fd = m->fd;
+  *data = m->data;
+  *size = m->size;
+  return 1;
+}
+
+/* a plain file, read and written in place */
+static int
+file_read (void *priv, off_t offset, size_t len, unsigned char *buf)
+{
+  int fd = *(int *) priv;
+  ssize_t n;
+
+  for (; len > 0; offset += n, buf += n, len -= n)
+    if ((n = pread (fd, buf, len, offset)) <= 0)
+      return 0;
+
+  return 1;
+}
+
+static int
+file_write (void *priv, off_t offset, size_t len, unsigned char *buf)
+{
+  int fd = *(int *) priv;
+  ssize_t n;
+
+  for (; len > 0; offset += n, buf += n, len -= n)
+    if ((n = pwrite (fd, buf, len, offset)) <= 0)
+      return 0;
+
+  return 1;
+}
+
+static void
+file_release (void *priv)
+{
+  close (*(int *) priv);
+  free (priv);
+}
+
+static const struct nativedev_ops file_ops = {
+  file_read,
+  file_write,
+  file_release,
+  NULL
+};
+
+/* a new, blank floppy on the open file 'fd', for adfCreateFlop().     */
+/* adfCreateDumpDevice() fills the whole image with zeros first; here  */
+/* the file is only extended to its size, so it stays a hole but for   */
+/* the few blocks the file system writes. the device is released by    */
+/* adfUnMountDev(), 'fd' stays open                                    */
+struct Device *
+nativedev_create (const char *name, int fd, long cylinders, long heads,
+		  long sectors)
+{
+  struct Device *dev;
+  off_t size = (off_t) cylinders * heads * sectors * LOGICAL_BLOCK_SIZE;
+  int *priv;
+
+  if (!nativedev_fits (size)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (ftruncate (fd, 0) == -1 || ftruncate (fd, size) == -1)
+    return NULL;
+
+  dev = calloc (1, sizeof *dev);
+  priv = malloc (sizeof *priv);
+  if (!dev || !priv || (*priv = dup (fd)) < 0) {
+    free (dev);
+    free (priv);
+    return NULL;
+  }
+
+  if (!nativedev_register (name, size, &file_ops, priv)) {
+    file_release (priv);
+    free (dev);
+    return NULL;
+  }
+
+  dev->cylinders = cylinders;
+  dev->heads = heads;
+  dev->sectors = sectors;
+  dev->devType = sectors == 22 ? DEVTYPE_FLOPHD : DEVTYPE_FLOPDD;
+  dev->isNativeDev = TRUE;
+  dev->readOnly = FALSE;
+  nativedev_init (dev, (char *) name, FALSE);
+
+  return dev;
+}
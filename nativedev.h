@@ -0,0 +1,32 @@
+#ifndef ADFTOOLS_NATIVEDEV_H
+#define ADFTOOLS_NATIVEDEV_H 1
+
+#include <sys/types.h>
+
+struct Device;
+
+/* how the native device driver reads and writes a registered image. */
+/* the functions return 1 on success and 0 on failure                */
+struct nativedev_ops {
+  int (*read) (void *priv, off_t offset, size_t len, unsigned char *buf);
+  int (*write) (void *priv, off_t offset, size_t len, unsigned char *buf);
+  void (*release) (void *priv);
+
+  /* optional, a hint that the given range will be read soon */
+  void (*prefetch) (void *priv, off_t offset, size_t len);
+};
+
+void nativedev_install (void);
+void nativedev_exit (void);
+int nativedev_fits (off_t size);
+int nativedev_register (const char *name, off_t size,
+			const struct nativedev_ops *ops, void *priv);
+int nativedev_map (const char *name);
+int nativedev_write_blocks (struct Device *dev, long n, long count,
+			    unsigned char *buf);
+int nativedev_source (struct Device *dev, int *fd, const unsigned char **data,
+		      size_t *size);
+struct Device *nativedev_create (const char *name, int fd, long cylinders,
+				 long heads, long sectors);
+
+#endif /* ADFTOOLS_NATIVEDEV_H */
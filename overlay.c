@@ -0,0 +1,522 @@
+/* overlay.c - copy-on-write overlays of images
+ *
+ * adftools - A complete package for maintaining image-files for the best
+ * Amiga-emulator out there: UAE - http://www.freiburg.linux.de/~uae/
+ *
+ * Copyright (C)2002-2015 Rikard Bosnjakovic <bos@hack.org>
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "lock.h"
+#include "nativedev.h"
+#include "overlay.h"
+#include "zfile.h"
+
+/* many copies of one image differ in a handful of blocks.  an overlay  */
+/* keeps only those: blocks that are written go to the delta file (at   */
+/* their own offset, the rest of the file is a hole) and get their bit  */
+/* set, everything else is read from the base image, which is never     */
+/* written to until the delta is committed.                             */
+
+#define HEADER_SIZE 4096
+#define BLOCK_SIZE  512
+
+struct overlay {
+  int delta;
+  int base;
+  off_t size;
+  off_t bitmap_off;
+  off_t data_off;
+  unsigned char *bitmap;
+  size_t bitmap_len;
+  int dirty;
+  char base_name[PATH_MAX];
+};
+
+static uint32_t
+get32 (const unsigned char *p)
+{
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint64_t
+get64 (const unsigned char *p)
+{
+  return get32 (p) | (uint64_t) get32 (p + 4) << 32;
+}
+
+static void
+put32 (unsigned char *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static void
+put64 (unsigned char *p, uint64_t v)
+{
+  put32 (p, v);
+  put32 (p + 4, v >> 32);
+}
+
+static int
+pread_all (int fd, void *buf, size_t len, off_t offset)
+{
+  unsigned char *p = buf;
+  ssize_t n;
+
+  while (len > 0) {
+    n = pread (fd, p, len, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    p += n;
+    offset += n;
+    len -= n;
+  }
+
+  return 1;
+}
+
+static int
+pwrite_all (int fd, const void *buf, size_t len, off_t offset)
+{
+  const unsigned char *p = buf;
+  ssize_t n;
+
+  while (len > 0) {
+    n = pwrite (fd, p, len, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    p += n;
+    offset += n;
+    len -= n;
+  }
+
+  return 1;
+}
+
+static int
+is_set (struct overlay *ov, long n)
+{
+  return ov->bitmap[n / 8] & (1 << (n % 8));
+}
+
+static void
+close_overlay (struct overlay *ov)
+{
+  if (ov->base >= 0)
+    close (ov->base);
+  close (ov->delta);
+  free (ov->bitmap);
+  free (ov);
+}
+
+/* whether the file 'name' starts like an overlay */
+static int
+has_magic (const char *name)
+{
+  unsigned char magic[8];
+  int fd, ret;
+
+  fd = open (name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+  ret = pread_all (fd, magic, sizeof magic, 0)
+    && memcmp (magic, OVERLAY_MAGIC, 8) == 0;
+  close (fd);
+
+  return ret;
+}
+
+/* opens the delta file 'name', and its base image read-only if       */
+/* 'open_base' is set. returns 0 if 'name' is no overlay, -1 if it is */
+/* but can't be used                                                  */
+static int
+open_overlay (const char *name, int rw, int open_base, struct overlay **result)
+{
+  unsigned char hdr[HEADER_SIZE];
+  struct overlay *ov;
+  struct stat st;
+  uint32_t len;
+  char *image;
+  int err;
+
+  ov = calloc (1, sizeof *ov);
+  if (!ov)
+    return -1;
+  ov->base = -1;
+
+  ov->delta = open (name, (rw ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+  if (ov->delta < 0) {
+    /* a read-only delta can't be written to, but it's still no image */
+    err = errno;
+    free (ov);
+    errno = err;
+    return has_magic (name) ? -1 : 0;
+  }
+
+  if (!pread_all (ov->delta, hdr, sizeof hdr, 0)
+      || memcmp (hdr, OVERLAY_MAGIC, 8) != 0) {
+    close (ov->delta);
+    free (ov);
+    return 0;
+  }
+
+  ov->size = get64 (hdr + 16);
+  ov->bitmap_off = get64 (hdr + 24);
+  ov->data_off = get64 (hdr + 32);
+  len = get32 (hdr + 40);
+  ov->bitmap_len = (ov->size / BLOCK_SIZE + 7) / 8;
+  if (get32 (hdr + 8) != OVERLAY_VERSION || get32 (hdr + 12) != BLOCK_SIZE
+      || ov->size % BLOCK_SIZE || len >= sizeof ov->base_name
+      || 44 + len > HEADER_SIZE || ov->bitmap_off < HEADER_SIZE
+      || ov->data_off < ov->bitmap_off + (off_t) ov->bitmap_len) {
+    errno = EINVAL;
+    goto fail;
+  }
+  memcpy (ov->base_name, hdr + 44, len);
+  ov->base_name[len] = '\0';
+
+  ov->bitmap = malloc (ov->bitmap_len + 1);
+  if (!ov->bitmap
+      || !pread_all (ov->delta, ov->bitmap, ov->bitmap_len, ov->bitmap_off))
+    goto fail;
+
+  if (open_base) {
+    /* read along with other readers, but not while it's committed to */
+    if (!lock_image (ov->base_name, 0))
+      goto fail;
+
+    /* the base may be compressed like any other image */
+    image = n_zfile_open (ov->base_name, "r", 0);
+    if (!image)
+      goto fail;
+
+    ov->base = open (image, O_RDONLY | O_CLOEXEC);
+    if (ov->base < 0 || fstat (ov->base, &st) == -1)
+      goto fail;
+    if (st.st_size != ov->size) {
+      /* the base image was replaced */
+      errno = EINVAL;
+      goto fail;
+    }
+  }
+
+  *result = ov;
+  return 1;
+
+ fail:
+  close_overlay (ov);
+  return -1;
+}
+
+/* reads blocks, each from the delta if it was written and from the base */
+/* image otherwise. adjacent blocks from the same file are read at once  */
+static int
+overlay_read (void *priv, off_t offset, size_t len, unsigned char *buf)
+{
+  struct overlay *ov = priv;
+  long n, last, end;
+  int fd;
+  off_t pos;
+  size_t bytes;
+
+  if (offset % BLOCK_SIZE || len % BLOCK_SIZE || offset + len > ov->size)
+    return 0;
+
+  n = offset / BLOCK_SIZE;
+  end = n + len / BLOCK_SIZE;
+  while (n < end) {
+    for (last = n + 1; last < end && !is_set (ov, last) == !is_set (ov, n); last++)
+      ;
+
+    fd = is_set (ov, n) ? ov->delta : ov->base;
+    pos = (off_t) n * BLOCK_SIZE + (fd == ov->delta ? ov->data_off : 0);
+    bytes = (size_t) (last - n) * BLOCK_SIZE;
+    if (!pread_all (fd, buf, bytes, pos))
+      return 0;
+
+    buf += bytes;
+    n = last;
+  }
+
+  return 1;
+}
+
+static int
+overlay_write (void *priv, off_t offset, size_t len, unsigned char *buf)
+{
+  struct overlay *ov = priv;
+  long n;
+
+  if (offset % BLOCK_SIZE || len % BLOCK_SIZE || offset + len > ov->size)
+    return 0;
+
+  if (!pwrite_all (ov->delta, buf, len, ov->data_off + offset))
+    return 0;
+
+  /* the bitmap goes out when the image is released, after the data */
+  for (n = offset / BLOCK_SIZE; n < (offset + len) / BLOCK_SIZE; n++)
+    ov->bitmap[n / 8] |= 1 << (n % 8);
+  ov->dirty = 1;
+
+  return 1;
+}
+
+static void
+overlay_release (void *priv)
+{
+  struct overlay *ov = priv;
+
+  if (ov->dirty
+      && !pwrite_all (ov->delta, ov->bitmap, ov->bitmap_len, ov->bitmap_off))
+    error (0, "Can't write the bitmap of an overlay: %s", strerror (errno));
+
+  close_overlay (ov);
+}
+
+static void
+overlay_prefetch (void *priv, off_t offset, size_t len)
+{
+  struct overlay *ov = priv;
+
+  posix_fadvise (ov->base, offset, len, POSIX_FADV_WILLNEED);
+  posix_fadvise (ov->delta, ov->data_off + offset, len, POSIX_FADV_WILLNEED);
+}
+
+static const struct nativedev_ops overlay_ops = {
+  overlay_read,
+  overlay_write,
+  overlay_release,
+  overlay_prefetch
+};
+
+/* if 'name' is an overlay, registers it with the native device driver. */
+/* returns 0 if it isn't, and -1 if it is but can't be opened           */
+int
+overlay_register (const char *name, int rw)
+{
+  struct overlay *ov;
+  int ret;
+
+  ret = open_overlay (name, rw, 1, &ov);
+  if (ret <= 0)
+    return ret;
+
+  /* only floppies can be served by the native device */
+  if (!nativedev_fits (ov->size)) {
+    close_overlay (ov);
+    errno = EFBIG;
+    return -1;
+  }
+
+  if (nativedev_register (name, ov->size, &overlay_ops, ov))
+    return 1;
+
+  close_overlay (ov);
+  return -1;
+}
+
+/* creates an empty delta file 'delta' on top of the image 'base' */
+int
+overlay_create (const char *base, const char *delta)
+{
+  unsigned char hdr[HEADER_SIZE];
+  char path[PATH_MAX];
+  char *image;
+  struct stat st;
+  size_t len, bitmap_len;
+  off_t data_off;
+  int fd;
+
+  if (!realpath (base, path))
+    return 0;
+
+  /* the size of a compressed base is the size of the image in it */
+  image = n_zfile_open (path, "r", 0);
+  if (!image || stat (image, &st) == -1)
+    return 0;
+
+  len = strlen (path);
+  if (st.st_size % BLOCK_SIZE || 44 + len > HEADER_SIZE) {
+    errno = EINVAL;
+    return 0;
+  }
+  if (!nativedev_fits (st.st_size)) {
+    errno = EFBIG;
+    return 0;
+  }
+
+  bitmap_len = (st.st_size / BLOCK_SIZE + 7) / 8;
+  data_off = HEADER_SIZE + (bitmap_len + HEADER_SIZE - 1) / HEADER_SIZE * HEADER_SIZE;
+
+  memset (hdr, 0, sizeof hdr);
+  memcpy (hdr, OVERLAY_MAGIC, 8);
+  put32 (hdr + 8, OVERLAY_VERSION);
+  put32 (hdr + 12, BLOCK_SIZE);
+  put64 (hdr + 16, st.st_size);
+  put64 (hdr + 24, HEADER_SIZE);
+  put64 (hdr + 32, data_off);
+  put32 (hdr + 40, len);
+  memcpy (hdr + 44, path, len);
+
+  fd = open (delta, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+  if (fd < 0)
+    return 0;
+
+  /* the bitmap is all zeros, and so are the (unused) data blocks */
+  if (!pwrite_all (fd, hdr, sizeof hdr, 0)
+      || ftruncate (fd, data_off + st.st_size) == -1
+      || close (fd) != 0) {
+    unlink (delta);
+    return 0;
+  }
+
+  return 1;
+}
+
+/* looks in 'dir' for another overlay than 'self' on the base of 'ov', */
+/* and puts its name in 'found'                                        */
+static int
+find_sibling (struct overlay *ov, const char *dir, const struct stat *self,
+	      char *found, size_t len)
+{
+  struct overlay *other;
+  struct dirent *de;
+  struct stat st;
+  DIR *d;
+  int ret = 0;
+
+  d = opendir (dir);
+  if (!d)
+    return 0;
+
+  while (!ret && (de = readdir (d))) {
+    snprintf (found, len, "%s/%s", dir, de->d_name);
+    if (stat (found, &st) == -1 || !S_ISREG (st.st_mode)
+	|| (st.st_dev == self->st_dev && st.st_ino == self->st_ino)
+	|| !has_magic (found) || open_overlay (found, 0, 0, &other) <= 0)
+      continue;
+
+    ret = strcmp (other->base_name, ov->base_name) == 0;
+    close_overlay (other);
+  }
+
+  closedir (d);
+  return ret;
+}
+
+/* writes the blocks of the delta into its base image and empties the */
+/* delta. the deltas of other overlays on the base were made against */
+/* the base as it is, so it isn't done while any are found next to   */
+/* the delta or the base                                              */
+int
+overlay_commit (const char *delta)
+{
+  unsigned char buf[BLOCK_SIZE];
+  char path[PATH_MAX], other[PATH_MAX];
+  struct overlay *ov;
+  struct stat self;
+  char *image;
+  long n;
+  int fd, ret = 1;
+
+  if (open_overlay (delta, 1, 0, &ov) <= 0)
+    return 0;
+
+  /* no one is to read or write either while they change */
+  if (!lock_image (delta, 1) || !lock_image (ov->base_name, 1)
+      || fstat (ov->delta, &self) == -1) {
+    close_overlay (ov);
+    return 0;
+  }
+
+  snprintf (path, sizeof path, "%s", delta);
+  if (find_sibling (ov, dirname (path), &self, other, sizeof other)
+      || (snprintf (path, sizeof path, "%s", ov->base_name),
+	  find_sibling (ov, dirname (path), &self, other, sizeof other))) {
+    error (0, "'%s' is an overlay of '%s' as well, flatten the overlays instead",
+	   other, ov->base_name);
+    close_overlay (ov);
+    errno = EBUSY;
+    return 0;
+  }
+
+  /* a compressed base is packed again when the program exits */
+  image = n_zfile_open (ov->base_name, "rw", 1);
+  fd = image ? open (image, O_WRONLY | O_CLOEXEC) : -1;
+  if (fd < 0) {
+    close_overlay (ov);
+    return 0;
+  }
+
+  for (n = 0; ret && n < ov->size / BLOCK_SIZE; n++)
+    if (is_set (ov, n))
+      ret = pread_all (ov->delta, buf, BLOCK_SIZE, ov->data_off + (off_t) n * BLOCK_SIZE)
+	&& pwrite_all (fd, buf, BLOCK_SIZE, (off_t) n * BLOCK_SIZE);
+
+  /* the base has to be complete before the delta is emptied */
+  if (fsync (fd) != 0 || close (fd) != 0)
+    ret = 0;
+
+  if (ret) {
+    memset (ov->bitmap, 0, ov->bitmap_len);
+    ret = pwrite_all (ov->delta, ov->bitmap, ov->bitmap_len, ov->bitmap_off)
+      && ftruncate (ov->delta, ov->data_off) == 0
+      && ftruncate (ov->delta, ov->data_off + ov->size) == 0;
+  }
+
+  close_overlay (ov);
+  return ret;
+}
+
+/* writes the image the overlay makes up into the new file 'output' */
+int
+overlay_flatten (const char *delta, const char *output)
+{
+  unsigned char buf[128 * BLOCK_SIZE];
+  struct overlay *ov;
+  off_t pos;
+  size_t len;
+  int fd, ret = 1;
+
+  if (open_overlay (delta, 0, 1, &ov) <= 0)
+    return 0;
+
+  fd = open (output, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    close_overlay (ov);
+    return 0;
+  }
+
+  for (pos = 0; ret && pos < ov->size; pos += len) {
+    len = ov->size - pos < sizeof buf ? ov->size - pos : sizeof buf;
+    ret = overlay_read (ov, pos, len, buf) && pwrite_all (fd, buf, len, pos);
+  }
+
+  if (close (fd) != 0)
+    ret = 0;
+  if (!ret)
+    unlink (output);
+
+  close_overlay (ov);
+  return ret;
+}
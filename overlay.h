@@ -0,0 +1,24 @@
+#ifndef ADFTOOLS_OVERLAY_H
+#define ADFTOOLS_OVERLAY_H 1
+
+/* an overlay is a delta file on top of a read-only base image: a header
+ * with the size and full path of the base, a bitmap of the blocks that
+ * were written, and those blocks at their own offsets in a sparse data
+ * area. all numbers are little-endian:
+ *
+ *   0  "ADFOVL\0\0"
+ *   8  version (u32), block size (u32)
+ *  16  image size (u64)
+ *  24  offset of the bitmap (u64)
+ *  32  offset of the data area (u64)
+ *  40  length of the path of the base (u32), then the path
+ */
+#define OVERLAY_MAGIC   "ADFOVL\0\0"
+#define OVERLAY_VERSION 1
+
+int overlay_create (const char *base, const char *delta);
+int overlay_register (const char *name, int rw);
+int overlay_commit (const char *delta);
+int overlay_flatten (const char *delta, const char *output);
+
+#endif /* ADFTOOLS_OVERLAY_H */
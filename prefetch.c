@@ -0,0 +1,271 @@
+/* prefetch.c - reads the files to be copied ahead of time
+ *
+ * adftools - A complete package for maintaining image-files for the best
+ * Amiga-emulator out there: UAE - http://www.freiburg.linux.de/~uae/
+ *
+ * Copyright (C)2002-2015 Rikard Bosnjakovic <bos@hack.org>
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "prefetch.h"
+
+/* the image can only be written from one thread, and copying a tree */
+/* file by file leaves it waiting for every file to be read.  here   */
+/* the files are listed in the order they will be copied, and a few  */
+/* threads read them into memory while the earlier ones are written. */
+/* the memory is bounded: a file is read only if it fits in what the */
+/* files read but not yet taken leave free, except for the very next */
+/* file, which is always read so the copy never waits for nothing.   */
+/* a file bigger than all of the memory isn't read at all.  files    */
+/* are handed out in order; a file that is asked for out of turn, or */
+/* whose size or time changed since it was listed, is read again by  */
+/* the caller                                                        */
+
+/* default memory for files read ahead (KB) */
+#define DEFAULT_KB (16 * 1024)
+
+/* number of reader threads */
+#define PREFETCH_THREADS 4
+
+enum { PENDING, READING, READY, FAILED, SKIPPED };
+
+struct item {
+  char *path;
+  size_t size;			/* when it was listed */
+  struct timespec mtime;
+  int state;
+  unsigned char *data;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+static struct item *items;
+static long n_items, max_items;
+static long next;		/* the next item to be read */
+static long head;		/* the next item to be handed out */
+static size_t budget, reserved;
+static pthread_t threads[PREFETCH_THREADS];
+static int n_threads;
+static int done;
+
+/* lists the file 'path', as 'st' says it is, as the next to be copied */
+int
+prefetch_add (const char *path, const struct stat *st)
+{
+  struct item *p;
+
+  if (n_items == max_items) {
+    max_items = max_items ? 2 * max_items : 64;
+    p = realloc (items, max_items * sizeof *items);
+    if (!p)
+      return 0;
+    items = p;
+  }
+
+  p = &items[n_items];
+  p->path = strdup (path);
+  if (!p->path)
+    return 0;
+  p->size = st->st_size;
+  p->mtime = st->st_mtim;
+  p->state = PENDING;
+  p->data = NULL;
+  n_items++;
+
+  return 1;
+}
+
+/* whether the open file 'fd' is still the one that was listed */
+static int
+unchanged (struct item *item, int fd)
+{
+  struct stat st;
+
+  return fstat (fd, &st) == 0 && (size_t) st.st_size == item->size
+    && st.st_mtim.tv_sec == item->mtime.tv_sec
+    && st.st_mtim.tv_nsec == item->mtime.tv_nsec;
+}
+
+/* reads the whole file, if it's still the way it was listed */
+static void
+read_item (struct item *item)
+{
+  size_t got = 0;
+  ssize_t n = 0;
+  int fd;
+
+  fd = open (item->path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+
+  if (unchanged (item, fd))
+    item->data = malloc (item->size ? item->size : 1);
+  if (item->data) {
+    while (got < item->size) {
+      n = read (fd, item->data + got, item->size - got);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	break;
+      got += n;
+    }
+    /* not written to while it was read either */
+    if (got < item->size || !unchanged (item, fd)) {
+      free (item->data);
+      item->data = NULL;
+    }
+  }
+
+  close (fd);
+}
+
+static void *
+reader_thread (void *arg)
+{
+  struct item *item;
+
+  pthread_mutex_lock (&lock);
+  for (;;) {
+    if (!done && next < n_items && items[next].state == SKIPPED) {
+      next++;
+      continue;
+    }
+
+    /* in order, and within the budget unless it's wanted right away */
+    if (!done && next < n_items && next != head
+	&& reserved + items[next].size > budget) {
+      pthread_cond_wait (&changed, &lock);
+      continue;
+    }
+    if (done || next >= n_items)
+      break;
+
+    item = &items[next++];
+    item->state = READING;
+    reserved += item->size;
+    pthread_mutex_unlock (&lock);
+
+    read_item (item);
+
+    pthread_mutex_lock (&lock);
+    item->state = item->data ? READY : FAILED;
+    pthread_cond_broadcast (&changed);
+  }
+  pthread_mutex_unlock (&lock);
+
+  return NULL;
+}
+
+/* starts reading the listed files */
+void
+prefetch_start (void)
+{
+  char *env = getenv (PREFETCH_ENV);
+  long kb = env ? atol (env) : DEFAULT_KB;
+  long i;
+
+  if (kb <= 0 || n_items == 0)
+    return;
+  budget = (size_t) kb * 1024;
+
+  /* those are read bit by bit by the caller */
+  for (i = 0; i < n_items; i++)
+    if (items[i].size > budget)
+      items[i].state = SKIPPED;
+
+  for (n_threads = 0; n_threads < PREFETCH_THREADS; n_threads++)
+    if (pthread_create (&threads[n_threads], NULL, reader_thread, NULL) != 0)
+      break;
+}
+
+/* lets go of the item at the head of the list */
+static void
+take (struct item *item)
+{
+  if (item->state != PENDING && item->state != SKIPPED)
+    reserved -= item->size;
+  free (item->path);
+  item->path = NULL;
+  head++;
+
+  /* skipped before it was read, it won't be */
+  if (next < head)
+    next = head;
+  pthread_cond_broadcast (&changed);
+}
+
+/* the file 'path' as it was read ahead. returns 0 if it wasn't, and it */
+/* has to be read the usual way                                         */
+int
+prefetch_get (const char *path, struct prefetched *file)
+{
+  long i;
+  int ret = 0;
+
+  if (!n_threads)
+    return 0;
+
+  pthread_mutex_lock (&lock);
+
+  /* the file should be the next one, else it's further on or not listed */
+  for (i = head; i < n_items && strcmp (items[i].path, path) != 0; i++)
+    ;
+  if (i == n_items) {
+    pthread_mutex_unlock (&lock);
+    return 0;
+  }
+
+  /* anything before it won't be asked for any more */
+  while (head < i) {
+    while (items[head].state == READING)
+      pthread_cond_wait (&changed, &lock);
+    free (items[head].data);
+    take (&items[head]);
+  }
+
+  while (items[head].state == PENDING || items[head].state == READING)
+    pthread_cond_wait (&changed, &lock);
+
+  if (items[head].state == READY) {
+    file->data = items[head].data;
+    file->size = items[head].size;
+    file->mtime = items[head].mtime.tv_sec;
+    ret = 1;
+  }
+  take (&items[head]);
+
+  pthread_mutex_unlock (&lock);
+  return ret;
+}
+
+/* stops the readers and forgets the files that weren't asked for */
+void
+prefetch_finish (void)
+{
+  long i;
+
+  pthread_mutex_lock (&lock);
+  done = 1;
+  pthread_cond_broadcast (&changed);
+  pthread_mutex_unlock (&lock);
+
+  for (i = 0; i < n_threads; i++)
+    pthread_join (threads[i], NULL);
+
+  for (i = head; i < n_items; i++) {
+    free (items[i].data);
+    free (items[i].path);
+  }
+  free (items);
+  items = NULL;
+  n_items = max_items = next = head = 0;
+  reserved = 0;
+  n_threads = 0;
+  done = 0;
+}
@@ -0,0 +1,23 @@
+#ifndef ADFTOOLS_PREFETCH_H
+#define ADFTOOLS_PREFETCH_H 1
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/* name of the environment variable with the memory for read files (KB) */
+#define PREFETCH_ENV "ADFTOOLS_PREFETCH"
+
+/* a file read ahead, the data is the caller's to free */
+struct prefetched {
+  unsigned char *data;
+  size_t size;
+  time_t mtime;
+};
+
+int prefetch_add (const char *path, const struct stat *st);
+void prefetch_start (void);
+int prefetch_get (const char *path, struct prefetched *file);
+void prefetch_finish (void);
+
+#endif /* ADFTOOLS_PREFETCH_H */
@@ -11,6 +11,7 @@
 #define ADFINSTALL	"adfinstall"
 #define ADFLIST		"adflist"
 #define ADFMAKEDIR	"adfmakedir"
+#define ADFOVERLAY	"adfoverlay"
 #define ADFRELABEL	"adfrelabel"
 #define ADFRENAME	"adfrename"
 
@@ -0,0 +1,432 @@
+/* writer.c - writes extracted files in the background
+ *
+ * adftools - A complete package for maintaining image-files for the best
+ * Amiga-emulator out there: UAE - http://www.freiburg.linux.de/~uae/
+ *
+ * Copyright (C)2002-2015 Rikard Bosnjakovic <bos@hack.org>
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "writer.h"
+
+/* ADFLib can only be used from one thread, so the files are read from */
+/* the image by the caller and handed over here whole, with their      */
+/* times, or as the runs of the image file they are stored in.  a few  */
+/* threads then create, preallocate, write, date and close them,       */
+/* relative to the descriptor of their directory, while the caller     */
+/* goes on to the next file.  a directory is dated when the last of    */
+/* its files is written and it's closed by the caller as well, so      */
+/* there is no pass over all the paths at the end                      */
+
+/* at most this much data waits to be written, the caller waits beyond */
+#define WRITER_BUDGET (16 * 1024 * 1024)
+
+/* default number of threads */
+#define WRITER_THREADS 4
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+struct wdir {
+  int fd;
+  int refs;			/* the caller and files not yet written */
+  char *path;			/* for messages */
+  int dated;			/* times[] is to be set */
+  struct timespec times[2];
+};
+
+struct job {
+  struct job *next;
+  struct wdir *dir;
+  char *name;
+  unsigned char *data;
+  size_t size;
+  struct timespec times[2];
+
+  /* or copied from an image, see writer_copy() */
+  int src_fd;
+  const unsigned char *src;
+  struct wrun *runs;
+  int n_runs;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t room = PTHREAD_COND_INITIALIZER;
+static struct job *head, **tail = &head;
+static size_t pending;		/* bytes queued or being written */
+static int done;
+static pthread_t *threads;
+static int n_threads;
+
+/* lets go of a reference to 'dir', the last one dates and closes it */
+static void
+release_dir (struct wdir *dir)
+{
+  int refs;
+
+  pthread_mutex_lock (&lock);
+  refs = --dir->refs;
+  pthread_mutex_unlock (&lock);
+  if (refs > 0)
+    return;
+
+  if (dir->dated && futimens (dir->fd, dir->times) == -1)
+    error (0, "cannot set timestamp for %s", dir->path);
+  close (dir->fd);
+  free (dir->path);
+  free (dir);
+}
+
+/* copies the runs of the job from the image to 'fd'. copy_file_range() */
+/* keeps the data in the kernel, or shares it on file systems that can; */
+/* where it can't be used, the runs are written from the mapping        */
+static int
+copy_runs (int fd, struct job *job)
+{
+  struct iovec iov[IOV_MAX];
+  off_t in, out = 0;
+  size_t len;
+  ssize_t n;
+  int i, k, kernel = 1;
+
+  for (i = 0; i < job->n_runs; ) {
+    if (kernel) {
+      in = job->runs[i].offset;
+      for (len = job->runs[i].len; len > 0; len -= n) {
+	n = copy_file_range (job->src_fd, &in, fd, &out, len, 0);
+	if (n <= 0)
+	  break;
+      }
+      if (len == 0) {
+	i++;
+	continue;
+      }
+
+      /* not between these files, the rest goes through write */
+      if (n < 0 && errno != EXDEV && errno != EINVAL && errno != ENOSYS
+	  && errno != EOPNOTSUPP)
+	return 0;
+      kernel = 0;
+      job->runs[i].len = len;
+      job->runs[i].offset = in;
+    }
+
+    for (k = 0; k < IOV_MAX && i + k < job->n_runs; k++) {
+      iov[k].iov_base = (void *) (job->src + job->runs[i + k].offset);
+      iov[k].iov_len = job->runs[i + k].len;
+    }
+    n = pwritev (fd, iov, k, out);
+    if (n <= 0)
+      return 0;
+    out += n;
+
+    /* skip what's written, a short write goes on in its run */
+    for (; i < job->n_runs && (size_t) n >= job->runs[i].len; i++)
+      n -= job->runs[i].len;
+    if (n > 0) {
+      job->runs[i].offset += n;
+      job->runs[i].len -= n;
+    }
+  }
+
+  return 1;
+}
+
+static void
+write_job (struct job *job)
+{
+  unsigned char *p = job->data;
+  size_t len = job->size;
+  ssize_t n = 0;
+  int fd;
+
+  fd = openat (job->dir->fd, job->name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    error (0, "%s/%s: Can't open file for output: %s", job->dir->path, job->name, strerror (errno));
+    return;
+  }
+
+  /* one extent for the whole file, if the file system can. it's only */
+  /* a hint, a failure is of no concern                               */
+  if (len > 0)
+    posix_fallocate (fd, 0, len);
+
+  if (job->runs)
+    len = copy_runs (fd, job) ? 0 : len;
+
+  for (; len > 0 && !job->runs; p += n, len -= n) {
+    n = write (fd, p, len);
+    if (n < 0 && errno == EINTR)
+      n = 0;
+    else if (n <= 0)
+      break;
+  }
+
+  if (len > 0)
+    error (0, "%s/%s: Can't write file: %s", job->dir->path, job->name, strerror (errno));
+  else {
+    if (futimens (fd, job->times) == -1)
+      error (0, "cannot set timestamp for %s/%s", job->dir->path, job->name);
+    printf ("Extracted file '%s/%s'\n", job->dir->path, job->name);
+  }
+
+  close (fd);
+}
+
+static void
+free_job (struct job *job)
+{
+  release_dir (job->dir);
+  free (job->runs);
+  free (job->data);
+  free (job->name);
+  free (job);
+}
+
+static void *
+writer_thread (void *arg)
+{
+  struct job *job;
+
+  pthread_mutex_lock (&lock);
+  for (;;) {
+    while (!head && !done)
+      pthread_cond_wait (&work, &lock);
+    if (!head)
+      break;
+
+    job = head;
+    head = job->next;
+    if (!head)
+      tail = &head;
+    pthread_mutex_unlock (&lock);
+
+    write_job (job);
+
+    pthread_mutex_lock (&lock);
+    pending -= job->runs ? 0 : job->size;
+    pthread_cond_signal (&room);
+    pthread_mutex_unlock (&lock);
+    free_job (job);
+    pthread_mutex_lock (&lock);
+  }
+  pthread_mutex_unlock (&lock);
+
+  return NULL;
+}
+
+/* starts the threads. without them, the files are written right away */
+int
+writer_start (void)
+{
+  char *env = getenv (WRITER_ENV);
+  int wanted = env ? atoi (env) : WRITER_THREADS;
+
+  if (wanted <= 0)
+    return 1;
+  if (wanted > 64)
+    wanted = 64;
+
+  threads = calloc (wanted, sizeof *threads);
+  if (!threads)
+    return 0;
+
+  for (n_threads = 0; n_threads < wanted; n_threads++)
+    if (pthread_create (&threads[n_threads], NULL, writer_thread, NULL) != 0)
+      break;
+
+  return 1;
+}
+
+/* waits for all the files to be written, and stops the threads */
+void
+writer_finish (void)
+{
+  int i;
+
+  pthread_mutex_lock (&lock);
+  done = 1;
+  pthread_cond_broadcast (&work);
+  pthread_mutex_unlock (&lock);
+
+  for (i = 0; i < n_threads; i++)
+    pthread_join (threads[i], NULL);
+
+  free (threads);
+  threads = NULL;
+  n_threads = 0;
+  done = 0;
+}
+
+static struct wdir *
+new_dir (int fd, const char *parent, const char *name)
+{
+  struct wdir *dir;
+
+  dir = calloc (1, sizeof *dir);
+  if (!dir) {
+    close (fd);
+    return NULL;
+  }
+
+  if (parent)
+    dir->path = malloc (strlen (parent) + 1 + strlen (name) + 1);
+  else
+    dir->path = strdup (name);
+  if (!dir->path) {
+    close (fd);
+    free (dir);
+    return NULL;
+  }
+  if (parent)
+    sprintf (dir->path, "%s/%s", parent, name);
+
+  dir->fd = fd;
+  dir->refs = 1;
+
+  return dir;
+}
+
+/* the path of 'dir', for messages */
+const char *
+writer_path (struct wdir *dir)
+{
+  return dir->path;
+}
+
+/* the existing directory 'path' to extract into */
+struct wdir *
+writer_root (const char *path)
+{
+  int fd;
+
+  fd = open (path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  return new_dir (fd, NULL, path);
+}
+
+/* the directory 'name' in 'parent', created if it doesn't exist. a */
+/* new directory gets the time 'mtime' once it's closed and written */
+struct wdir *
+writer_mkdir (struct wdir *parent, const char *name,
+	      const struct timespec *mtime)
+{
+  struct wdir *dir;
+  int created, fd;
+
+  created = mkdirat (parent->fd, name, 0755) == 0;
+  if (!created && errno != EEXIST)
+    return NULL;
+
+  fd = openat (parent->fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  dir = new_dir (fd, parent->path, name);
+  if (dir && created) {
+    notify ("Created dir '%s'.\n", dir->path);
+    if (mtime) {
+      dir->times[0] = dir->times[1] = *mtime;
+      dir->dated = 1;
+    }
+  }
+
+  return dir;
+}
+
+static void
+queue_job (struct wdir *dir, const char *name, unsigned char *data,
+	   size_t size, const struct timespec *mtime, int src_fd,
+	   const unsigned char *src, struct wrun *runs, int n_runs)
+{
+  struct job *job;
+  size_t held = runs ? 0 : size;	/* memory the job holds on to */
+
+  job = calloc (1, sizeof *job);
+  if (job)
+    job->name = strdup (name);
+  if (!job || !job->name) {
+    error (0, "%s/%s: %s", dir->path, name, strerror (errno));
+    free (job);
+    free (data);
+    free (runs);
+    return;
+  }
+
+  job->dir = dir;
+  job->data = data;
+  job->size = size;
+  job->src_fd = src_fd;
+  job->src = src;
+  job->runs = runs;
+  job->n_runs = n_runs;
+  if (mtime)
+    job->times[0] = job->times[1] = *mtime;
+  else
+    job->times[0].tv_nsec = job->times[1].tv_nsec = UTIME_OMIT;
+
+  pthread_mutex_lock (&lock);
+  dir->refs++;
+  if (!n_threads) {
+    pthread_mutex_unlock (&lock);
+    write_job (job);
+    free_job (job);
+    return;
+  }
+
+  /* a file bigger than the budget waits for all the others */
+  while (pending > 0 && pending + held > WRITER_BUDGET)
+    pthread_cond_wait (&room, &lock);
+  pending += held;
+  *tail = job;
+  tail = &job->next;
+  pthread_cond_signal (&work);
+  pthread_mutex_unlock (&lock);
+}
+
+/* writes 'size' bytes of 'data' to the file 'name' in 'dir' and dates */
+/* it 'mtime'. 'data' is freed once it's written                       */
+void
+writer_file (struct wdir *dir, const char *name, unsigned char *data,
+	     size_t size, const struct timespec *mtime)
+{
+  queue_job (dir, name, data, size, mtime, -1, NULL, NULL, 0);
+}
+
+/* copies the file 'name' in 'dir' from the runs of the open image */
+/* 'src_fd', which is mapped at 'src', and dates it 'mtime'. 'runs' */
+/* is freed when it's done; the image has to stay open until then   */
+void
+writer_copy (struct wdir *dir, const char *name, int src_fd,
+	     const unsigned char *src, struct wrun *runs, int n_runs,
+	     const struct timespec *mtime)
+{
+  size_t size = 0;
+  int i;
+
+  for (i = 0; i < n_runs; i++)
+    size += runs[i].len;
+
+  queue_job (dir, name, NULL, size, mtime, src_fd, src, runs, n_runs);
+}
+
+/* the caller is done with 'dir' */
+void
+writer_close (struct wdir *dir)
+{
+  release_dir (dir);
+}
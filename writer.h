@@ -0,0 +1,32 @@
+#ifndef ADFTOOLS_WRITER_H
+#define ADFTOOLS_WRITER_H 1
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* name of the environment variable with the number of writer threads */
+#define WRITER_ENV "ADFTOOLS_WRITE_THREADS"
+
+struct wdir;
+
+/* a contiguous part of a file in an image */
+struct wrun {
+  off_t offset;
+  size_t len;
+};
+
+int writer_start (void);
+void writer_finish (void);
+struct wdir *writer_root (const char *path);
+struct wdir *writer_mkdir (struct wdir *parent, const char *name,
+			   const struct timespec *mtime);
+void writer_file (struct wdir *dir, const char *name, unsigned char *data,
+		  size_t size, const struct timespec *mtime);
+void writer_copy (struct wdir *dir, const char *name, int src_fd,
+		  const unsigned char *src, struct wrun *runs, int n_runs,
+		  const struct timespec *mtime);
+void writer_close (struct wdir *dir);
+const char *writer_path (struct wdir *dir);
+
+#endif /* ADFTOOLS_WRITER_H */
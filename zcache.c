@@ -0,0 +1,221 @@
+/* zcache.c - persistent cache of decompressed images
+ *
+ * adftools - A complete package for maintaining image-files for the best
+ * Amiga-emulator out there: UAE - http://www.freiburg.linux.de/~uae/
+ *
+ * Copyright (C)2002-2015 Rikard Bosnjakovic <bos@hack.org>
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "zcache.h"
+
+/* the cache is only used when ADFTOOLS_CACHE is set to its maximum size */
+/* in megabytes. it lives in $XDG_CACHE_HOME/adftools (~/.cache/adftools */
+/* by default) and holds one decompressed image per file, named after    */
+/* the device, inode, mtime and size of the compressed image.  an entry  */
+/* gets its mtime bumped on every hit, and the entries with the oldest   */
+/* mtime are thrown away when the cache grows beyond its maximum size.   */
+
+/* leaves room for the names of the entries in a PATH_MAX buffer */
+#define CACHE_DIR_MAX (PATH_MAX - 64)
+
+static char cache_dir[CACHE_DIR_MAX];
+static off_t cache_max;
+static int cache_checked;
+
+/* one file in the cache directory, used when evicting */
+struct cache_entry {
+  char name[NAME_MAX + 1];
+  struct timespec mtime;
+  off_t size;
+};
+
+/* checks (once) whether the cache is enabled, and sets it up if so */
+static int
+zcache_enabled (void)
+{
+  char base[CACHE_DIR_MAX - sizeof "/adftools"];
+  char *size, *dir;
+
+  if (cache_checked)
+    return cache_max > 0;
+  cache_checked = 1;
+
+  size = getenv (ZCACHE_ENV);
+  if (!size || atol (size) <= 0)
+    return 0;
+
+  dir = getenv ("XDG_CACHE_HOME");
+  if (dir && *dir)
+    snprintf (base, sizeof base, "%s", dir);
+  else if ((dir = getenv ("HOME")))
+    snprintf (base, sizeof base, "%s/.cache", dir);
+  else
+    return 0;
+
+  mkdir (base, 0700);
+  snprintf (cache_dir, sizeof cache_dir, "%s/adftools", base);
+  if (mkdir (cache_dir, 0700) == -1 && errno != EEXIST)
+    return 0;
+
+  cache_max = (off_t) atol (size) * 1024 * 1024;
+  return 1;
+}
+
+/* the name of the cache entry for a compressed image */
+static void
+cache_name (const struct stat *st, char *path, size_t len)
+{
+  snprintf (path, len, "%s/%llx-%llx-%llx.%09ld-%llx.adf", cache_dir,
+	    (unsigned long long) st->st_dev,
+	    (unsigned long long) st->st_ino,
+	    (unsigned long long) st->st_mtim.tv_sec, st->st_mtim.tv_nsec,
+	    (unsigned long long) st->st_size);
+}
+
+/* oldest first */
+static int
+compare_mtime (const void *a, const void *b)
+{
+  const struct cache_entry *x = a, *y = b;
+
+  if (x->mtime.tv_sec != y->mtime.tv_sec)
+    return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+  if (x->mtime.tv_nsec != y->mtime.tv_nsec)
+    return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : 1;
+
+  return 0;
+}
+
+/* throw away the least recently used entries until the cache fits */
+static void
+zcache_evict (void)
+{
+  struct cache_entry *entries = NULL, *tmp;
+  struct dirent *dirp;
+  struct stat st;
+  off_t total = 0;
+  int n = 0, max = 0, i;
+  DIR *dp;
+
+  dp = opendir (cache_dir);
+  if (!dp)
+    return;
+
+  while ((dirp = readdir (dp)) != NULL) {
+    /* skips ".", ".." and unfinished entries */
+    if (dirp->d_name[0] == '.')
+      continue;
+
+    if (fstatat (dirfd (dp), dirp->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1
+	|| !S_ISREG (st.st_mode))
+      continue;
+
+    if (n == max) {
+      max = max ? max * 2 : 64;
+      tmp = realloc (entries, max * sizeof *entries);
+      if (!tmp)
+	break;
+      entries = tmp;
+    }
+
+    strcpy (entries[n].name, dirp->d_name);
+    entries[n].mtime = st.st_mtim;
+    entries[n].size = st.st_size;
+    total += st.st_size;
+    n++;
+  }
+
+  if (total > cache_max) {
+    qsort (entries, n, sizeof *entries, compare_mtime);
+    for (i = 0; i < n && total > cache_max; i++)
+      if (unlinkat (dirfd (dp), entries[i].name, 0) == 0)
+	total -= entries[i].size;
+  }
+
+  closedir (dp);
+  free (entries);
+}
+
+/* copies a whole (decompressed) image from one descriptor to another */
+int
+zcache_copy (int src, int dst)
+{
+  struct stat st;
+  off_t pos = 0;
+  ssize_t n;
+
+  if (fstat (src, &st) == -1)
+    return 0;
+
+  while (pos < st.st_size) {
+    n = sendfile (dst, src, &pos, st.st_size - pos);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+  }
+
+  return 1;
+}
+
+/* looks for a decompressed copy of the compressed image 'st'. returns  */
+/* an open (read-only) descriptor for it and its name in 'path', or -1  */
+int
+zcache_lookup (const struct stat *st, char *path, size_t len)
+{
+  int fd;
+
+  if (!zcache_enabled ())
+    return -1;
+
+  cache_name (st, path, len);
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  /* mark the entry as recently used */
+  futimens (fd, NULL);
+
+  return fd;
+}
+
+/* stores the decompressed image in 'fd' as the cache entry for 'st' */
+void
+zcache_store (const struct stat *st, int fd)
+{
+  char path[PATH_MAX], tmpname[PATH_MAX];
+  int out, ok;
+
+  if (!zcache_enabled ())
+    return;
+
+  /* write to a temporary name so other processes never see half an image */
+  snprintf (tmpname, sizeof tmpname, "%s/.tmpXXXXXX", cache_dir);
+  out = mkstemp (tmpname);
+  if (out < 0)
+    return;
+
+  ok = zcache_copy (fd, out);
+  if (close (out) != 0)
+    ok = 0;
+
+  cache_name (st, path, sizeof path);
+  if (!ok || rename (tmpname, path) == -1) {
+    unlink (tmpname);
+    return;
+  }
+
+  zcache_evict ();
+}
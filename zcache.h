@@ -0,0 +1,13 @@
+#ifndef ADFTOOLS_ZCACHE_H
+#define ADFTOOLS_ZCACHE_H 1
+
+#include <sys/stat.h>
+
+/* name of the environment variable that enables the cache */
+#define ZCACHE_ENV "ADFTOOLS_CACHE"
+
+int zcache_lookup (const struct stat *st, char *path, size_t len);
+void zcache_store (const struct stat *st, int fd);
+int zcache_copy (int src, int dst);
+
+#endif /* ADFTOOLS_ZCACHE_H */
@@ -8,94 +8,1645 @@
  * Modified 2013-11-22 by Rikard Bosnjakovic <bos@hack.org> for
  * use in the adftools package.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <zlib.h>
+#include <bzlib.h>
+#include <lzma.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
+#include "adfz.h"
+#include "zcache.h"
 #include "zfile.h"
 
+/* a compression format */
+struct codec
+{
+  const char *name;
+  const char *magic;
+  size_t magic_len;
+  const char *const *suffixes;
+
+  /* streaming decompression. ropen() takes over the descriptor */
+  void *(*ropen) (int fd);
+  ssize_t (*read) (void *stream, void *buf, size_t len);
+  void (*rclose) (void *stream);
+
+  /* optional whole-file decompression, tried before the reader */
+  int (*decompress) (int src, int dst);
+
+  /* compresses the whole image in 'src' to 'dst' */
+  int (*compress) (int src, int dst);
+
+  /* optional, like compress() but may reuse parts of 'old', the */
+  /* previous version of the compressed file                      */
+  int (*repack) (int src, int old, int dst);
+};
+
+/* the longest magic of all codecs (xz) */
+#define MAGIC_MAX 6
+
 static struct zfile
 {
   struct zfile *next;
   FILE *f;
+  int fd;			/* the decompressed image, -1 if none */
+  unsigned short temporary;	/* 'name' is a temporary file to unlink */
   unsigned short compressed;
   unsigned short re_compress;
+  const struct codec *codec;
   char orgname[256];
   char name[256];
-} *zlist;
+
+  /* the decompressed image as it was, to tell whether it was modified */
+  struct timespec mtime;
+  off_t size;
+  uLong crc;
+
+  /* re-compression running in the background */
+  pthread_t thread;
+  unsigned short busy;
+} *zlist, *zpending;
+
+#define ZBUFSIZE 65536
 
 /*
- * gzip decompression
+ * write() all of buf, restarting on short writes
  */
 static int
-gunzip (const char *decompress, const char *src, const char *dst)
+write_all (int fd, const void *buf, size_t len)
 {
-    char cmd[1024];
-    if (!dst)
-	return 1;
-    sprintf (cmd, "%s -c -d \"%s\" > \"%s\"", decompress, src, dst);
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+	n = write (fd, p, len);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return 0;
+	}
+	p += n;
+	len -= n;
+    }
 
-    return !system (cmd);
+    return 1;
+}
+
+/* an integer from the environment, or 'def' if unset or silly */
+static int
+getenv_int (const char *name, int def, int min, int max)
+{
+    char *value = getenv (name);
+    int n;
+
+    if (!value || !*value)
+	return def;
+
+    n = atoi (value);
+    return (n < min || n > max) ? def : n;
 }
 
 /*
- * decompresses the file (or check if dest is null)
+ * creates an anonymous in-memory file for a decompressed image and
+ * puts a name for it, usable by fopen() and ADFLib, in 'name'
  */
 static int
-uncompress (const char *name, char *dest)
+create_image_file (struct zfile *l)
 {
-    char *ext = strrchr (name, '.');
-    char nam[1024];
+    int fd;
 
-    if (ext != NULL && access (name, 0) >= 0) {
-	ext++;
-	if (strcasecmp (ext, "z") == 0
-	    || strcasecmp (ext, "gz") == 0
-	    || strcasecmp (ext, "adz") == 0
-	    || strcasecmp (ext, "roz") == 0)
-	    return gunzip ("gzip", name, dest);
-	if (strcasecmp (ext, "bz") == 0)
-	    return gunzip ("bzip", name, dest);
-	if (strcasecmp (ext, "bz2") == 0)
-	    return gunzip ("bzip2", name, dest);
+#ifdef MFD_CLOEXEC
+    fd = memfd_create ("adftools", MFD_CLOEXEC);
+    if (fd >= 0) {
+	snprintf (l->name, sizeof l->name, "/proc/self/fd/%d", fd);
+	l->temporary = 0;
+	return fd;
     }
+#endif
 
-    if (access (strcat (strcpy (nam, name), ".z"), 0) >= 0
-        || access (strcat (strcpy (nam, name), ".Z"), 0) >= 0
-        || access (strcat (strcpy (nam, name), ".gz"), 0) >= 0
-        || access (strcat (strcpy (nam, name), ".GZ"), 0) >= 0
-        || access (strcat (strcpy (nam, name), ".adz"), 0) >= 0
-        || access (strcat (strcpy (nam, name), ".roz"), 0) >= 0)
-        return gunzip ("gzip", nam, dest);
+    /* no memfd support, fall back to a temporary file on disk */
+    strcpy (l->name, "/tmp/adftoolsXXXXXX");
+    l->temporary = 1;
+    return mkstemp (l->name);
+}
 
-    if (access (strcat (strcpy (nam, name), ".bz"), 0) >= 0
-        || access (strcat (strcpy (nam, name), ".BZ"), 0) >= 0)
-        return gunzip ("bzip", nam, dest);
+/*
+ * an anonymous file for an image that is built from scratch, named
+ * "/proc/self/fd/N" in 'name'. it goes away when the descriptor is closed
+ */
+int
+zfile_memfile (char *name, size_t len)
+{
+    char tmpname[] = "/tmp/adftoolsXXXXXX";
+    int fd;
 
-    if (access (strcat (strcpy (nam, name), ".bz2"), 0) >= 0
-        || access (strcat (strcpy (nam, name), ".BZ2"), 0) >= 0)
-        return gunzip ("bzip2", nam, dest);
+#ifdef MFD_CLOEXEC
+    fd = memfd_create ("adftools", MFD_CLOEXEC);
+    if (fd < 0)
+#endif
+    {
+	fd = mkstemp (tmpname);
+	if (fd < 0)
+	    return -1;
+	unlink (tmpname);
+    }
 
-    return 0;
+    snprintf (name, len, "/proc/self/fd/%d", fd);
+    return fd;
 }
 
+/*
+ * the image on standard input, as a file. a pipe is copied into memory
+ * on the first call, later calls return the same name. the image is
+ * unpacked, if needed, when it is opened by its name like any other
+ */
+const char *
+zfile_stdin (void)
+{
+    static char name[64];
+    static int fd = -1;
+    char buf[ZBUFSIZE];
+    struct stat st;
+    ssize_t n;
+
+    if (fd >= 0)
+	return name;
+
+    /* redirected from a file, nothing to copy */
+    if (fstat (0, &st) == 0 && S_ISREG (st.st_mode)) {
+	fd = 0;
+	snprintf (name, sizeof name, "/proc/self/fd/0");
+	return name;
+    }
+
+    fd = zfile_memfile (name, sizeof name);
+    if (fd < 0)
+	return NULL;
+
+    /* splice() moves the pipe buffers without copying them through */
+    /* user space, plain reads are left for everything else          */
+    while ((n = splice (0, NULL, fd, NULL, 1 << 20, SPLICE_F_MOVE)) > 0)
+	;
+    if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+	while ((n = read (0, buf, sizeof buf)) > 0)
+	    if (!write_all (fd, buf, n)) {
+		n = -1;
+		break;
+	    }
+
+    if (n < 0) {
+	close (fd);
+	fd = -1;
+	return NULL;
+    }
+
+    return name;
+}
+
+/*
+ * read from the start of the (uncompressed) image, for the compressors
+ */
+static ssize_t
+read_image (int src, void *buf, size_t len, off_t *pos)
+{
+    ssize_t n;
+
+    do
+	n = pread (src, buf, len, *pos);
+    while (n < 0 && errno == EINTR);
+
+    if (n > 0)
+	*pos += n;
+
+    return n;
+}
+
+/*
+ * gzip, via zlib
+ */
+static void *
+gz_ropen (int fd)
+{
+    return gzdopen (fd, "rb");
+}
+
+static ssize_t
+gz_read (void *stream, void *buf, size_t len)
+{
+    int n, err;
+
+    /* gzread() takes a file that ends early for one still being written */
+    n = gzread (stream, buf, len);
+    if (n == 0 && (gzerror (stream, &err), err == Z_BUF_ERROR))
+	return -1;
+
+    return n;
+}
+
+static void
+gz_rclose (void *stream)
+{
+    gzclose (stream);
+}
+
+/*
+ * parallel gzip compression, in the spirit of pigz. the image is cut
+ * in chunks that are deflated on their own by a number of threads, each
+ * primed with the last 32K of the previous chunk as dictionary. all
+ * chunks but the last end with a sync flush, which leaves them byte
+ * aligned, so they simply follow each other in one standard gzip
+ * member. the thread count and level are taken from the environment
+ */
+#define GZ_CHUNK  (128 * 1024)
+#define GZ_DICT   32768
+
+struct gz_chunk
+{
+    unsigned char *out;
+    size_t len;
+    uLong crc;
+    int done;			/* 1 when deflated, -1 on failure */
+};
+
+struct gz_job
+{
+    const unsigned char *image;
+    size_t size;
+    int level;
+    int n_chunks;
+    int next;			/* next chunk to deflate */
+    int written;		/* chunks written so far */
+    int window;			/* how far the deflaters may run ahead */
+    struct gz_chunk *chunks;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/* deflates chunk 'i' of the image */
 static int
-compress (const char *src, const char *dst)
+gz_deflate_chunk (struct gz_job *job, int i)
 {
-  char cmd[1024];
-  if (!dst)
+    struct gz_chunk *chunk = &job->chunks[i];
+    size_t start = (size_t) i * GZ_CHUNK;
+    size_t len = job->size - start < GZ_CHUNK ? job->size - start : GZ_CHUNK;
+    int last = (i == job->n_chunks - 1);
+    size_t max;
+    z_stream s;
+    int ret;
+
+    memset (&s, 0, sizeof s);
+    if (deflateInit2 (&s, job->level, Z_DEFLATED, -MAX_WBITS, 8,
+		      Z_DEFAULT_STRATEGY) != Z_OK)
+	return 0;
+
+    if (i > 0)
+	deflateSetDictionary (&s, job->image + start - GZ_DICT, GZ_DICT);
+
+    /* room for the worst case plus the sync marker */
+    max = deflateBound (&s, len) + 16;
+    chunk->out = malloc (max);
+    if (!chunk->out) {
+	deflateEnd (&s);
+	return 0;
+    }
+
+    s.next_in = (Bytef *) job->image + start;
+    s.avail_in = len;
+    s.next_out = chunk->out;
+    s.avail_out = max;
+    ret = deflate (&s, last ? Z_FINISH : Z_SYNC_FLUSH);
+    chunk->len = max - s.avail_out;
+    deflateEnd (&s);
+
+    if ((last && ret != Z_STREAM_END) || (!last && (ret != Z_OK || s.avail_in)))
+	return 0;
+
+    chunk->crc = crc32 (0L, job->image + start, len);
     return 1;
+}
+
+static void *
+gz_deflater (void *arg)
+{
+    struct gz_job *job = arg;
+    int i, ok;
+
+    pthread_mutex_lock (&job->lock);
+    for (;;) {
+	/* don't run too far ahead of the writer, it bounds the memory used */
+	while (job->next < job->n_chunks && job->next >= job->written + job->window)
+	    pthread_cond_wait (&job->cond, &job->lock);
+	if (job->next >= job->n_chunks)
+	    break;
+	i = job->next++;
+
+	pthread_mutex_unlock (&job->lock);
+	ok = gz_deflate_chunk (job, i);
+	pthread_mutex_lock (&job->lock);
+
+	job->chunks[i].done = ok ? 1 : -1;
+	pthread_cond_broadcast (&job->cond);
+    }
+    pthread_mutex_unlock (&job->lock);
+
+    return NULL;
+}
+
+/* equivalent to "gzip -9n": neither name nor timestamp is stored */
+static int
+gz_compress (int src, int dst)
+{
+    static const unsigned char empty[] = { 0 };
+    unsigned char header[10] = { 0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 3 };
+    unsigned char trailer[8];
+    struct gz_chunk *chunk;
+    struct gz_job job;
+    pthread_t *threads;
+    struct stat st;
+    uLong crc = crc32 (0L, Z_NULL, 0);
+    int n_threads, started, i;
+    int ret = 1;
+
+    if (fstat (src, &st) == -1)
+	return 0;
+
+    memset (&job, 0, sizeof job);
+    job.size = st.st_size;
+    job.level = getenv_int ("ADFTOOLS_GZIP_LEVEL", 9, 1, 9);
+    job.n_chunks = job.size ? (job.size + GZ_CHUNK - 1) / GZ_CHUNK : 1;
+    n_threads = getenv_int ("ADFTOOLS_GZIP_THREADS",
+			    sysconf (_SC_NPROCESSORS_ONLN), 1, 256);
+    if (n_threads > job.n_chunks)
+	n_threads = job.n_chunks;
+    job.window = 2 * n_threads;
+
+    if (job.size) {
+	job.image = mmap (NULL, job.size, PROT_READ, MAP_SHARED, src, 0);
+	if (job.image == MAP_FAILED)
+	    return 0;
+    } else
+	job.image = empty;
+
+    job.chunks = calloc (job.n_chunks, sizeof *job.chunks);
+    threads = calloc (n_threads, sizeof *threads);
+    if (!job.chunks || !threads) {
+	free (job.chunks);
+	free (threads);
+	if (job.size)
+	    munmap ((void *) job.image, job.size);
+	return 0;
+    }
+    pthread_mutex_init (&job.lock, NULL);
+    pthread_cond_init (&job.cond, NULL);
+
+    /* the writer is the calling thread, it deflates as well if no thread starts */
+    for (started = 0; started < n_threads; started++)
+	if (pthread_create (&threads[started], NULL, gz_deflater, &job) != 0)
+	    break;
+    if (started == 0) {
+	job.window = job.n_chunks;
+	gz_deflater (&job);
+    }
+
+    /* XFL tells the maximum or the fastest compression was used */
+    header[8] = job.level == 9 ? 2 : job.level == 1 ? 4 : 0;
+    if (!write_all (dst, header, sizeof header))
+	ret = 0;
+
+    /* write the chunks in order as they get ready */
+    for (i = 0; i < job.n_chunks; i++) {
+	chunk = &job.chunks[i];
+
+	pthread_mutex_lock (&job.lock);
+	while (!chunk->done)
+	    pthread_cond_wait (&job.cond, &job.lock);
+	pthread_mutex_unlock (&job.lock);
+
+	if (chunk->done < 0 || (ret && !write_all (dst, chunk->out, chunk->len)))
+	    ret = 0;
+	crc = crc32_combine (crc, chunk->crc,
+			     job.size - (size_t) i * GZ_CHUNK < GZ_CHUNK
+			     ? job.size - (size_t) i * GZ_CHUNK : GZ_CHUNK);
+	free (chunk->out);
+	chunk->out = NULL;
+
+	pthread_mutex_lock (&job.lock);
+	job.written++;
+	pthread_cond_broadcast (&job.cond);
+	pthread_mutex_unlock (&job.lock);
+    }
+
+    for (i = 0; i < started; i++)
+	pthread_join (threads[i], NULL);
+
+    /* crc32 and size of the uncompressed data, little-endian */
+    for (i = 0; i < 4; i++) {
+	trailer[i] = (crc >> (8 * i)) & 0xff;
+	trailer[4 + i] = ((unsigned long) job.size >> (8 * i)) & 0xff;
+    }
+    if (ret && !write_all (dst, trailer, sizeof trailer))
+	ret = 0;
+
+    pthread_mutex_destroy (&job.lock);
+    pthread_cond_destroy (&job.cond);
+    free (job.chunks);
+    free (threads);
+    if (job.size)
+	munmap ((void *) job.image, job.size);
+
+    return ret;
+}
+
+/*
+ * bzip2, via libbz2. the low-level interface is used since
+ * BZ2_bzread() stops after the first of several concatenated streams
+ */
+struct bz_reader
+{
+    int fd;
+    int eof;
+    int in_stream;		/* a stream is started but not ended */
+    bz_stream s;
+    char in[ZBUFSIZE];
+};
+
+static void *
+bz_ropen (int fd)
+{
+    struct bz_reader *r;
+
+    r = calloc (1, sizeof *r);
+    if (!r)
+	return NULL;
+
+    if (BZ2_bzDecompressInit (&r->s, 0, 0) != BZ_OK) {
+	free (r);
+	return NULL;
+    }
+    r->fd = fd;
+
+    return r;
+}
+
+static ssize_t
+bz_read (void *stream, void *buf, size_t len)
+{
+    struct bz_reader *r = stream;
+    unsigned int avail;
+    ssize_t n;
+    int ret;
+
+    r->s.next_out = buf;
+    r->s.avail_out = len;
+
+    while (r->s.avail_out > 0) {
+	if (r->s.avail_in == 0 && !r->eof) {
+	    n = read (r->fd, r->in, sizeof r->in);
+	    if (n < 0)
+		return -1;
+	    if (n == 0)
+		r->eof = 1;
+	    r->s.next_in = r->in;
+	    r->s.avail_in = n;
+	}
+
+	if (r->s.avail_in == 0 && r->eof && !r->in_stream)
+	    break;
+
+	avail = r->s.avail_out;
+	ret = BZ2_bzDecompress (&r->s);
+	if (ret == BZ_STREAM_END) {
+	    /* another stream might follow (pbzip2 and friends) */
+	    r->in_stream = 0;
+	    BZ2_bzDecompressEnd (&r->s);
+	    if (BZ2_bzDecompressInit (&r->s, 0, 0) != BZ_OK)
+		return -1;
+	} else if (ret != BZ_OK)
+	    return -1;
+	else {
+	    r->in_stream = 1;
+
+	    /* the file ends in the middle of a stream */
+	    if (r->s.avail_in == 0 && r->eof && r->s.avail_out == avail)
+		return -1;
+	}
+    }
+
+    return len - r->s.avail_out;
+}
+
+static void
+bz_rclose (void *stream)
+{
+    struct bz_reader *r = stream;
+
+    BZ2_bzDecompressEnd (&r->s);
+    close (r->fd);
+    free (r);
+}
+
+static int
+bz_compress (int src, int dst)
+{
+    char in[ZBUFSIZE], out[ZBUFSIZE];
+    bz_stream s;
+    off_t pos = 0;
+    ssize_t n;
+    int action = BZ_RUN;
+    int ret = BZ_SEQUENCE_ERROR;
+
+    memset (&s, 0, sizeof s);
+    if (BZ2_bzCompressInit (&s, 9, 0, 0) != BZ_OK)
+	return 0;
+
+    do {
+	if (s.avail_in == 0 && action == BZ_RUN) {
+	    n = read_image (src, in, sizeof in, &pos);
+	    if (n < 0) {
+		BZ2_bzCompressEnd (&s);
+		return 0;
+	    }
+	    if (n == 0)
+		action = BZ_FINISH;
+	    s.next_in = in;
+	    s.avail_in = n;
+	}
+
+	s.next_out = out;
+	s.avail_out = sizeof out;
+	ret = BZ2_bzCompress (&s, action);
+	if (ret < 0)
+	    break;
+	if (!write_all (dst, out, sizeof out - s.avail_out)) {
+	    BZ2_bzCompressEnd (&s);
+	    return 0;
+	}
+    } while (ret != BZ_STREAM_END);
+
+    BZ2_bzCompressEnd (&s);
+    return ret == BZ_STREAM_END;
+}
+
+/*
+ * parallel bzip2 decompression. a bzip2 stream is a row of blocks that
+ * are compressed independently of each other, each starting with a
+ * 48-bit magic at an arbitrary bit offset. the blocks are found by
+ * scanning for that magic, and each one is wrapped into a stream of its
+ * own ("BZh9" + block + end-of-stream marker + crc) which is then
+ * decompressed by one of a number of threads. as the magic might just as
+ * well show up inside compressed data, any failure makes the caller fall
+ * back to the plain sequential reader
+ */
+#define BZ_BLOCK_MAGIC  0x314159265359ULL
+#define BZ_EOS_MAGIC    0x177245385090ULL
+#define BZ_MAGIC_MASK   0xffffffffffffULL
+
+struct bz_block
+{
+    uint64_t start;		/* bit offsets in the compressed file */
+    uint64_t end;
+    unsigned char *out;
+    size_t len;
+    int done;			/* 1 when decompressed, -1 on failure */
+};
+
+struct bz_job
+{
+    const unsigned char *data;
+    size_t size;
+    int n_blocks;
+    int next;
+    int written;
+    int window;
+    struct bz_block *blocks;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/* 'n' bits (at most 64) from 'data' at bit offset 'pos', msb first */
+static uint64_t
+get_bits (const unsigned char *data, uint64_t pos, int n)
+{
+    uint64_t v = 0;
+
+    while (n--) {
+	v = (v << 1) | ((data[pos >> 3] >> (7 - (pos & 7))) & 1);
+	pos++;
+    }
+
+    return v;
+}
+
+/* appends the low 'n' bits of 'v' to 'buf' at bit offset '*pos' */
+static void
+put_bits (unsigned char *buf, uint64_t *pos, uint64_t v, int n)
+{
+    while (n--) {
+	if ((v >> n) & 1)
+	    buf[*pos >> 3] |= 0x80 >> (*pos & 7);
+	(*pos)++;
+    }
+}
+
+/* finds the block and end-of-stream markers, returns the number of blocks */
+static int
+bz_find_blocks (struct bz_job *job)
+{
+    struct bz_block *tmp;
+    uint64_t reg = 0, magic, pos;
+    int max = 0, n = 0;
+    size_t i;
+    int shift;
+
+    job->blocks = NULL;
+    for (i = 0; i < job->size; i++) {
+	reg = (reg << 8) | job->data[i];
+	if (i < 6)
+	    continue;
+
+	for (shift = 7; shift >= 0; shift--) {
+	    magic = (reg >> shift) & BZ_MAGIC_MASK;
+	    if (magic != BZ_BLOCK_MAGIC && magic != BZ_EOS_MAGIC)
+		continue;
+
+	    /* a marker ends the previous block */
+	    pos = (uint64_t) (i + 1) * 8 - shift - 48;
+	    if (n > 0 && job->blocks[n - 1].end == 0)
+		job->blocks[n - 1].end = pos;
+
+	    if (magic == BZ_BLOCK_MAGIC) {
+		if (n == max) {
+		    max = max ? max * 2 : 64;
+		    tmp = realloc (job->blocks, max * sizeof *tmp);
+		    if (!tmp)
+			return -1;
+		    job->blocks = tmp;
+		}
+		memset (&job->blocks[n], 0, sizeof job->blocks[n]);
+		job->blocks[n++].start = pos;
+	    }
+	}
+    }
+
+    /* a stream without end marker, let libbz2 complain about it */
+    if (n > 0 && job->blocks[n - 1].end == 0)
+	job->blocks[n - 1].end = (uint64_t) job->size * 8;
+
+    return n;
+}
+
+/* decompresses one block, wrapped into a stream of its own */
+static int
+bz_decompress_block (struct bz_job *job, struct bz_block *block)
+{
+    uint64_t bits = block->end - block->start;
+    uint64_t pos, crc;
+    size_t len, max, k;
+    unsigned char *in, *tmp;
+    int shift = block->start & 7;
+    const unsigned char *p = job->data + (block->start >> 3);
+    bz_stream s;
+    int ret;
+
+    /* the block needs at least its magic and crc */
+    if (bits < 80)
+	return 0;
+    crc = get_bits (job->data, block->start + 48, 32);
+
+    len = 4 + (bits + 48 + 32 + 7) / 8;
+    in = calloc (1, len);
+    if (!in)
+	return 0;
+
+    /* stream header, then the block itself shifted to a byte boundary */
+    memcpy (in, "BZh9", 4);
+    for (k = 0; k < bits / 8; k++)
+	in[4 + k] = shift ? (p[k] << shift) | (p[k + 1] >> (8 - shift)) : p[k];
+    pos = (4 + bits / 8) * 8;
+    put_bits (in, &pos, get_bits (job->data, block->start + (bits & ~7ULL), bits & 7), bits & 7);
+
+    /* the crc of a single-block stream is the crc of that block */
+    put_bits (in, &pos, BZ_EOS_MAGIC, 48);
+    put_bits (in, &pos, crc, 32);
+
+    memset (&s, 0, sizeof s);
+    if (BZ2_bzDecompressInit (&s, 0, 0) != BZ_OK) {
+	free (in);
+	return 0;
+    }
+
+    max = 1024 * 1024;
+    block->out = malloc (max);
+    s.next_in = (char *) in;
+    s.avail_in = len;
+    ret = BZ_OK;
+    while (block->out && ret == BZ_OK) {
+	if (block->len == max) {
+	    max *= 2;
+	    tmp = realloc (block->out, max);
+	    if (!tmp)
+		break;
+	    block->out = tmp;
+	}
+	s.next_out = (char *) block->out + block->len;
+	s.avail_out = max - block->len;
+	ret = BZ2_bzDecompress (&s);
+	block->len = max - s.avail_out;
+    }
+
+    BZ2_bzDecompressEnd (&s);
+    free (in);
+
+    return ret == BZ_STREAM_END;
+}
+
+static void *
+bz_decompressor (void *arg)
+{
+    struct bz_job *job = arg;
+    int i, ok;
+
+    pthread_mutex_lock (&job->lock);
+    for (;;) {
+	/* the writer decides how far we may run ahead */
+	while (job->next < job->n_blocks && job->next >= job->written + job->window)
+	    pthread_cond_wait (&job->cond, &job->lock);
+	if (job->next >= job->n_blocks)
+	    break;
+	i = job->next++;
+
+	pthread_mutex_unlock (&job->lock);
+	ok = bz_decompress_block (job, &job->blocks[i]);
+	pthread_mutex_lock (&job->lock);
+
+	job->blocks[i].done = ok ? 1 : -1;
+	pthread_cond_broadcast (&job->cond);
+    }
+    pthread_mutex_unlock (&job->lock);
+
+    return NULL;
+}
+
+static int
+bz_decompress (int src, int dst)
+{
+    struct bz_block *block;
+    struct bz_job job;
+    pthread_t *threads;
+    struct stat st;
+    int n_threads, started, i;
+    int ret = 1;
+
+    n_threads = getenv_int ("ADFTOOLS_BZIP2_THREADS",
+			    sysconf (_SC_NPROCESSORS_ONLN), 1, 256);
+    if (n_threads < 2 || fstat (src, &st) == -1 || st.st_size < 6)
+	return 0;
+
+    memset (&job, 0, sizeof job);
+    job.size = st.st_size;
+    job.data = mmap (NULL, job.size, PROT_READ, MAP_SHARED, src, 0);
+    if (job.data == MAP_FAILED)
+	return 0;
+
+    /* nothing to gain from a single block */
+    job.n_blocks = bz_find_blocks (&job);
+    if (job.n_blocks < 2) {
+	free (job.blocks);
+	munmap ((void *) job.data, job.size);
+	return 0;
+    }
+
+    if (n_threads > job.n_blocks)
+	n_threads = job.n_blocks;
+    job.window = 2 * n_threads;
+
+    threads = calloc (n_threads, sizeof *threads);
+    if (!threads) {
+	free (job.blocks);
+	munmap ((void *) job.data, job.size);
+	return 0;
+    }
+    pthread_mutex_init (&job.lock, NULL);
+    pthread_cond_init (&job.cond, NULL);
+
+    for (started = 0; started < n_threads; started++)
+	if (pthread_create (&threads[started], NULL, bz_decompressor, &job) != 0)
+	    break;
+    if (started == 0) {
+	job.window = job.n_blocks;
+	bz_decompressor (&job);
+    }
+
+    /* write the blocks in order, as they get ready */
+    for (i = 0; i < job.n_blocks; i++) {
+	block = &job.blocks[i];
+
+	pthread_mutex_lock (&job.lock);
+	while (!block->done)
+	    pthread_cond_wait (&job.cond, &job.lock);
+	pthread_mutex_unlock (&job.lock);
+
+	if (block->done < 0 || (ret && !write_all (dst, block->out, block->len)))
+	    ret = 0;
+	free (block->out);
+	block->out = NULL;
+
+	pthread_mutex_lock (&job.lock);
+	job.written++;
+	pthread_cond_broadcast (&job.cond);
+	pthread_mutex_unlock (&job.lock);
+    }
+
+    for (i = 0; i < started; i++)
+	pthread_join (threads[i], NULL);
+
+    pthread_mutex_destroy (&job.lock);
+    pthread_cond_destroy (&job.cond);
+    free (job.blocks);
+    free (threads);
+    munmap ((void *) job.data, job.size);
+
+    return ret;
+}
+
+/*
+ * xz, via liblzma
+ */
+struct xz_reader
+{
+    int fd;
+    lzma_action action;
+    lzma_stream s;
+    unsigned char in[ZBUFSIZE];
+};
+
+static void *
+xz_ropen (int fd)
+{
+    struct xz_reader *r;
+    lzma_stream init = LZMA_STREAM_INIT;
+
+    r = malloc (sizeof *r);
+    if (!r)
+	return NULL;
+
+    r->s = init;
+    if (lzma_stream_decoder (&r->s, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) {
+	free (r);
+	return NULL;
+    }
+    r->fd = fd;
+    r->action = LZMA_RUN;
+
+    return r;
+}
+
+static ssize_t
+xz_read (void *stream, void *buf, size_t len)
+{
+    struct xz_reader *r = stream;
+    lzma_ret ret;
+    ssize_t n;
+
+    r->s.next_out = buf;
+    r->s.avail_out = len;
+
+    while (r->s.avail_out > 0) {
+	if (r->s.avail_in == 0 && r->action == LZMA_RUN) {
+	    n = read (r->fd, r->in, sizeof r->in);
+	    if (n < 0)
+		return -1;
+	    if (n == 0)
+		r->action = LZMA_FINISH;
+	    r->s.next_in = r->in;
+	    r->s.avail_in = n;
+	}
+
+	ret = lzma_code (&r->s, r->action);
+	if (ret == LZMA_STREAM_END)
+	    break;
+	if (ret != LZMA_OK)
+	    return -1;
+    }
+
+    return len - r->s.avail_out;
+}
+
+static void
+xz_rclose (void *stream)
+{
+    struct xz_reader *r = stream;
+
+    lzma_end (&r->s);
+    close (r->fd);
+    free (r);
+}
+
+static int
+xz_compress (int src, int dst)
+{
+    unsigned char in[ZBUFSIZE], out[ZBUFSIZE];
+    lzma_stream s = LZMA_STREAM_INIT;
+    lzma_action action = LZMA_RUN;
+    lzma_ret ret = LZMA_PROG_ERROR;
+    off_t pos = 0;
+    ssize_t n;
+
+    if (lzma_easy_encoder (&s, 6, LZMA_CHECK_CRC64) != LZMA_OK)
+	return 0;
+
+    do {
+	if (s.avail_in == 0 && action == LZMA_RUN) {
+	    n = read_image (src, in, sizeof in, &pos);
+	    if (n < 0) {
+		lzma_end (&s);
+		return 0;
+	    }
+	    if (n == 0)
+		action = LZMA_FINISH;
+	    s.next_in = in;
+	    s.avail_in = n;
+	}
+
+	s.next_out = out;
+	s.avail_out = sizeof out;
+	ret = lzma_code (&s, action);
+	if (ret != LZMA_OK && ret != LZMA_STREAM_END)
+	    break;
+	if (!write_all (dst, out, sizeof out - s.avail_out)) {
+	    lzma_end (&s);
+	    return 0;
+	}
+    } while (ret != LZMA_STREAM_END);
+
+    lzma_end (&s);
+    return ret == LZMA_STREAM_END;
+}
+
+#ifdef HAVE_ZSTD
+/*
+ * zstd, via libzstd
+ */
+struct zstd_reader
+{
+    int fd;
+    int eof;
+    size_t left;		/* non-zero while a frame is not complete */
+    ZSTD_DStream *ds;
+    ZSTD_inBuffer input;
+    char in[ZBUFSIZE];
+};
+
+static void *
+zstd_ropen (int fd)
+{
+    struct zstd_reader *r;
+
+    r = calloc (1, sizeof *r);
+    if (!r)
+	return NULL;
+
+    r->ds = ZSTD_createDStream ();
+    if (!r->ds) {
+	free (r);
+	return NULL;
+    }
+    ZSTD_initDStream (r->ds);
+    r->fd = fd;
+    r->input.src = r->in;
+
+    return r;
+}
+
+static ssize_t
+zstd_read (void *stream, void *buf, size_t len)
+{
+    struct zstd_reader *r = stream;
+    ZSTD_outBuffer output = { buf, len, 0 };
+    size_t pos;
+    ssize_t n;
+
+    while (output.pos < output.size) {
+	if (r->input.pos == r->input.size && !r->eof) {
+	    n = read (r->fd, r->in, sizeof r->in);
+	    if (n < 0)
+		return -1;
+	    if (n == 0)
+		r->eof = 1;
+	    r->input.size = n;
+	    r->input.pos = 0;
+	}
+
+	if (r->input.pos == r->input.size && r->eof && r->left == 0)
+	    break;
+
+	pos = output.pos;
+	r->left = ZSTD_decompressStream (r->ds, &output, &r->input);
+	if (ZSTD_isError (r->left))
+	    return -1;
+
+	/* the file ends in the middle of a frame */
+	if (r->input.pos == r->input.size && r->eof && r->left != 0
+	    && output.pos == pos)
+	    return -1;
+    }
+
+    return output.pos;
+}
+
+static void
+zstd_rclose (void *stream)
+{
+    struct zstd_reader *r = stream;
+
+    ZSTD_freeDStream (r->ds);
+    close (r->fd);
+    free (r);
+}
+
+/* level 3 (the zstd default) keeps the write-back of images cheap */
+static int
+zstd_compress (int src, int dst)
+{
+    char in[ZBUFSIZE], out[ZBUFSIZE];
+    ZSTD_CCtx *cctx;
+    ZSTD_EndDirective mode = ZSTD_e_continue;
+    ZSTD_inBuffer input = { in, 0, 0 };
+    ZSTD_outBuffer output;
+    off_t pos = 0;
+    ssize_t n;
+    size_t left;
+    int ret = 0;
+
+    cctx = ZSTD_createCCtx ();
+    if (!cctx)
+	return 0;
+    ZSTD_CCtx_setParameter (cctx, ZSTD_c_compressionLevel, 3);
+
+    for (;;) {
+	if (input.pos == input.size && mode == ZSTD_e_continue) {
+	    n = read_image (src, in, sizeof in, &pos);
+	    if (n < 0)
+		break;
+	    if (n == 0)
+		mode = ZSTD_e_end;
+	    input.size = n;
+	    input.pos = 0;
+	}
+
+	output.dst = out;
+	output.size = sizeof out;
+	output.pos = 0;
+	left = ZSTD_compressStream2 (cctx, &output, &input, mode);
+	if (ZSTD_isError (left) || !write_all (dst, out, output.pos))
+	    break;
+	if (mode == ZSTD_e_end && left == 0) {
+	    ret = 1;
+	    break;
+	}
+    }
+
+    ZSTD_freeCCtx (cctx);
+    return ret;
+}
+#endif /* HAVE_ZSTD */
+
+/*
+ * compress(1) LZW, as "gzip -d" used to unpack for us. there is only a
+ * reader: a modified image is packed back with gzip, like gzip did. the
+ * codes are read in groups of eight, and when the code size changes or
+ * the table is cleared the rest of the group is skipped
+ */
+#define LZW_BITS	16
+#define LZW_CLEAR	256
+#define LZW_BLOCK_MODE	0x80
+
+struct lzw_reader
+{
+    int fd;
+    int max_bits;
+    int block_mode;
+    int n_bits;
+    long max_code;		/* the biggest code of n_bits */
+    long free_ent;		/* the next entry of the table */
+    long old_code;
+    int fin_char;
+    int n_codes;		/* codes read in the current size */
+    uint32_t bits;
+    int n_in_bits;
+    unsigned char *sp;		/* output left in stack[] */
+    unsigned short prefix[1 << LZW_BITS];
+    unsigned char suffix[1 << LZW_BITS];
+    unsigned char stack[1 << LZW_BITS];
+    unsigned char in[ZBUFSIZE];
+    size_t in_pos, in_len;
+};
+
+/* the next byte of the file, -1 at its end and -2 on errors */
+static int
+lzw_byte (struct lzw_reader *r)
+{
+    ssize_t n;
+
+    if (r->in_pos == r->in_len) {
+	do
+	    n = read (r->fd, r->in, sizeof r->in);
+	while (n < 0 && errno == EINTR);
+	if (n <= 0)
+	    return n < 0 ? -2 : -1;
+	r->in_pos = 0;
+	r->in_len = n;
+    }
+
+    return r->in[r->in_pos++];
+}
+
+/* the next code, -1 at the end of the file and -2 on errors */
+static long
+lzw_code (struct lzw_reader *r)
+{
+    long code;
+    int c;
+
+    while (r->n_in_bits < r->n_bits) {
+	c = lzw_byte (r);
+	if (c < 0)
+	    return c;
+	r->bits |= (uint32_t) c << r->n_in_bits;
+	r->n_in_bits += 8;
+    }
+
+    code = r->bits & ((1 << r->n_bits) - 1);
+    r->bits >>= r->n_bits;
+    r->n_in_bits -= r->n_bits;
+    r->n_codes++;
+
+    return code;
+}
+
+/* skips to the end of the group of codes and changes to 'n_bits' */
+static void
+lzw_resize (struct lzw_reader *r, int n_bits)
+{
+    while (r->n_codes % 8 != 0 && lzw_code (r) >= 0)
+	;
+
+    r->n_codes = 0;
+    r->n_bits = n_bits;
+    r->max_code = n_bits == r->max_bits ? 1L << n_bits : (1L << n_bits) - 1;
+}
+
+static void *
+lzw_ropen (int fd)
+{
+    struct lzw_reader *r;
+    int i, c[3];
+
+    r = calloc (1, sizeof *r);
+    if (!r)
+	return NULL;
+    r->fd = fd;
+
+    for (i = 0; i < 3; i++)
+	c[i] = lzw_byte (r);
+    r->max_bits = c[2] & 0x1f;
+    if (c[0] != 0x1f || c[1] != 0x9d || r->max_bits < 9 || r->max_bits > LZW_BITS) {
+	free (r);
+	return NULL;
+    }
+
+    r->block_mode = c[2] & LZW_BLOCK_MODE;
+    r->free_ent = r->block_mode ? LZW_CLEAR + 1 : LZW_CLEAR;
+    r->old_code = -1;
+    r->sp = r->stack + sizeof r->stack;
+    lzw_resize (r, 9);
+
+    return r;
+}
+
+static ssize_t
+lzw_read (void *stream, void *buf, size_t len)
+{
+    struct lzw_reader *r = stream;
+    unsigned char *end = r->stack + sizeof r->stack;
+    unsigned char *out = buf;
+    long code, in_code;
+    size_t n;
+
+    for (;;) {
+	n = end - r->sp < len ? end - r->sp : len;
+	memcpy (out, r->sp, n);
+	r->sp += n;
+	out += n;
+	len -= n;
+	if (len == 0)
+	    break;
+
+	if (r->free_ent > r->max_code)
+	    lzw_resize (r, r->n_bits + 1);
+
+	code = lzw_code (r);
+	if (code == -2)
+	    return -1;
+	if (code < 0)
+	    break;
+
+	if (r->old_code < 0) {
+	    if (code >= 256)
+		return -1;
+	    r->old_code = r->fin_char = code;
+	    *--r->sp = code;
+	    continue;
+	}
+
+	if (code == LZW_CLEAR && r->block_mode) {
+	    r->free_ent = LZW_CLEAR;
+	    lzw_resize (r, 9);
+	    continue;
+	}
+
+	/* the string is built backwards on the stack */
+	in_code = code;
+	if (code >= r->free_ent) {
+	    /* the entry that is about to be made, KwKwK */
+	    if (code > r->free_ent)
+		return -1;
+	    *--r->sp = r->fin_char;
+	    code = r->old_code;
+	}
+	while (code >= 256) {
+	    *--r->sp = r->suffix[code];
+	    code = r->prefix[code];
+	}
+	*--r->sp = r->fin_char = code;
+
+	if (r->free_ent < 1L << r->max_bits) {
+	    r->prefix[r->free_ent] = r->old_code;
+	    r->suffix[r->free_ent] = r->fin_char;
+	    r->free_ent++;
+	}
+	r->old_code = in_code;
+    }
+
+    return out - (unsigned char *) buf;
+}
+
+static void
+lzw_rclose (void *stream)
+{
+    struct lzw_reader *r = stream;
+
+    close (r->fd);
+    free (r);
+}
+
+/*
+ * the track-compressed adfz container, see adfz.c
+ */
+struct az_reader
+{
+    int fd;
+    struct adfz *z;
+    off_t pos;
+};
+
+static void *
+az_ropen (int fd)
+{
+    struct az_reader *r;
+
+    r = malloc (sizeof *r);
+    if (!r)
+	return NULL;
+
+    r->z = adfz_open (fd);
+    if (!r->z) {
+	free (r);
+	return NULL;
+    }
+    r->fd = fd;
+    r->pos = 0;
+
+    return r;
+}
+
+static ssize_t
+az_read (void *stream, void *buf, size_t len)
+{
+    struct az_reader *r = stream;
+    off_t left = adfz_size (r->z) - r->pos;
+
+    if (len > left)
+	len = left;
+    if (!adfz_pread (r->z, r->pos, len, buf))
+	return -1;
+
+    r->pos += len;
+    return len;
+}
+
+static void
+az_rclose (void *stream)
+{
+    struct az_reader *r = stream;
+
+    adfz_close (r->z);
+    close (r->fd);
+    free (r);
+}
+
+static int
+az_compress (int src, int dst)
+{
+    return adfz_compress (src, -1, dst);
+}
+
+/*
+ * the supported compression formats. they are recognized by their magic
+ * bytes, the suffixes are only used when looking for "name.suffix" when
+ * "name" itself does not exist
+ */
+static const char *const gz_suffixes[] = { ".z", ".gz", ".GZ", ".adz", ".roz", NULL };
+static const char *const bz_suffixes[] = { ".bz", ".BZ", ".bz2", ".BZ2", NULL };
+static const char *const xz_suffixes[] = { ".xz", ".XZ", NULL };
+static const char *const lzw_suffixes[] = { ".Z", NULL };
+static const char *const az_suffixes[] = { ADFZ_SUFFIX, ".ADFZ", NULL };
+#ifdef HAVE_ZSTD
+static const char *const zstd_suffixes[] = { ".zst", ".ZST", NULL };
+#endif
+
+static const struct codec codecs[] =
+{
+    { "gzip",  "\x1f\x8b",             2, gz_suffixes,
+      gz_ropen, gz_read, gz_rclose, NULL, gz_compress, NULL },
+    { "bzip2", "BZh",                  3, bz_suffixes,
+      bz_ropen, bz_read, bz_rclose, bz_decompress, bz_compress, NULL },
+    { "xz",    "\xfd" "7zXZ\0",        6, xz_suffixes,
+      xz_ropen, xz_read, xz_rclose, NULL, xz_compress, NULL },
+    { "lzw",   "\x1f\x9d",             2, lzw_suffixes,
+      lzw_ropen, lzw_read, lzw_rclose, NULL, gz_compress, NULL },
+#ifdef HAVE_ZSTD
+    { "zstd",  "\x28\xb5\x2f\xfd",     4, zstd_suffixes,
+      zstd_ropen, zstd_read, zstd_rclose, NULL, zstd_compress, NULL },
+#endif
+    { "adfz",  ADFZ_MAGIC,             4, az_suffixes,
+      az_ropen, az_read, az_rclose, adfz_decompress, az_compress, adfz_compress },
+
+    /* end of codecs */
+    { NULL, NULL, 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+/*
+ * finds the codec for an open file by looking at its first bytes
+ */
+static const struct codec *
+sniff_codec (int fd)
+{
+    unsigned char magic[MAGIC_MAX];
+    const struct codec *c;
+    ssize_t n;
+
+    n = pread (fd, magic, sizeof magic, 0);
+    for (c = codecs; n > 0 && c->name; c++)
+	if (n >= c->magic_len && memcmp (magic, c->magic, c->magic_len) == 0)
+	    return c;
+
+    return NULL;
+}
+
+/*
+ * opens 'name' (or, if it does not exist, the first "name.suffix" that
+ * does) and puts the codec it is compressed with in 'codec', NULL if the
+ * file is not compressed. the name of the opened file ends up in 'path'
+ */
+static int
+open_image (const char *name, const struct codec **codec, char *path, size_t len)
+{
+    const struct codec *c;
+    const char *const *suffix;
+    int fd;
+
+    *codec = NULL;
+    snprintf (path, len, "%s", name);
+
+    fd = open (name, O_RDONLY | O_CLOEXEC);
+    for (c = codecs; fd < 0 && errno == ENOENT && c->name; c++)
+	for (suffix = c->suffixes; fd < 0 && *suffix; suffix++) {
+	    snprintf (path, len, "%s%s", name, *suffix);
+	    fd = open (path, O_RDONLY | O_CLOEXEC);
+	}
+
+    if (fd >= 0)
+	*codec = sniff_codec (fd);
+
+    return fd;
+}
+
+/*
+ * decompresses the open file 'src' into 'dst'. 'src' is always closed
+ */
+static int
+decompress_file (const struct codec *codec, int src, int dst)
+{
+    char buf[ZBUFSIZE];
+    void *stream;
+    ssize_t n;
 
-  if (access (dst, W_OK) == 0) {
-    sprintf (cmd, "gzip -9nc \"%s\" > \"%s\"", src, dst);
-    return !system (cmd);
+    if (codec->decompress) {
+	if (codec->decompress (src, dst)) {
+	    close (src);
+	    return 1;
+	}
+
+	/* didn't work out, start over with the plain reader */
+	if (ftruncate (dst, 0) == -1 || lseek (dst, 0, SEEK_SET) == -1) {
+	    close (src);
+	    return 0;
+	}
+    }
+
+    stream = codec->ropen (src);
+    if (!stream) {
+	close (src);
+	return 0;
+    }
+
+    while ((n = codec->read (stream, buf, sizeof buf)) > 0)
+	if (!write_all (dst, buf, n)) {
+	    n = -1;
+	    break;
+	}
+
+    codec->rclose (stream);
+    return n == 0;
+}
+
+/*
+ * compresses the image in 'src' back over the file 'dst'. the new file
+ * is written next to 'dst' and renamed over it when complete, so 'dst'
+ * is never left half-written
+ */
+static int
+compress_file (const struct codec *codec, int src, const char *dst)
+{
+  char path[PATH_MAX], tmpname[PATH_MAX + 16];
+  char *base;
+  struct stat st;
+  int fd, old;
+  int ret;
+
+  /* replace the file a symlink points to, not the symlink itself */
+  if (!realpath (dst, path) || access (path, W_OK) != 0
+      || stat (path, &st) == -1)
+    return 0;
+
+  base = strrchr (path, '/') + 1;
+  snprintf (tmpname, sizeof tmpname, "%.*s.%s.XXXXXX",
+	    (int) (base - path), path, base);
+  fd = mkstemp (tmpname);
+  if (fd < 0) {
+    /* the directory is not writable, overwrite the file in place */
+    fd = open (path, O_WRONLY | O_TRUNC | O_CLOEXEC);
+    if (fd < 0)
+      return 0;
+
+    ret = codec->compress (src, fd);
+    if (close (fd) != 0)
+      ret = 0;
+
+    return ret;
   }
 
-  return 0;
+  old = codec->repack ? open (path, O_RDONLY | O_CLOEXEC) : -1;
+  if (old >= 0) {
+    ret = codec->repack (src, old, fd);
+    close (old);
+  } else
+    ret = codec->compress (src, fd);
+  if (ret) {
+    /* keep the owner and permissions of the original */
+    fchmod (fd, st.st_mode & 07777);
+    if (fchown (fd, st.st_uid, st.st_gid) == -1)
+      fchmod (fd, st.st_mode & 0777);
+    if (fsync (fd) != 0)
+      ret = 0;
+  }
+
+  if (close (fd) != 0)
+    ret = 0;
+
+  if (!ret || rename (tmpname, path) == -1) {
+    unlink (tmpname);
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * crc of a whole decompressed image
+ */
+static uLong
+image_crc (int fd)
+{
+    char buf[ZBUFSIZE];
+    uLong crc = crc32 (0L, Z_NULL, 0);
+    off_t pos = 0;
+    ssize_t n;
+
+    while ((n = read_image (fd, buf, sizeof buf, &pos)) > 0)
+	crc = crc32 (crc, (Bytef *) buf, n);
+
+    return crc;
+}
+
+/*
+ * remembers the state of a freshly decompressed image
+ */
+static void
+remember_image (struct zfile *l)
+{
+    struct stat st;
+
+    fstat (l->fd, &st);
+    l->mtime = st.st_mtim;
+    l->size = st.st_size;
+    l->crc = image_crc (l->fd);
+}
+
+/*
+ * has the decompressed image been written to?
+ */
+static int
+image_changed (struct zfile *l)
+{
+    struct stat st;
+
+    if (fstat (l->fd, &st) == -1)
+	return 1;
+
+    if (st.st_size != l->size
+	|| st.st_mtim.tv_sec != l->mtime.tv_sec
+	|| st.st_mtim.tv_nsec != l->mtime.tv_nsec)
+	return 1;
+
+    /* file times are coarse, a write right after the decompression */
+    /* does not necessarily show up in the mtime                    */
+    return image_crc (l->fd) != l->crc;
+}
+
+/*
+ * packs a modified image and remembers it for the next run
+ */
+static void *
+recompress (void *arg)
+{
+    struct zfile *l = arg;
+    struct stat st;
+
+    if (compress_file (l->codec, l->fd, l->orgname)
+	&& stat (l->orgname, &st) == 0)
+	zcache_store (&st, l->fd);
+
+    return NULL;
+}
+
+/*
+ * closes the image and, if it was modified, starts packing it on a
+ * worker thread. the zfile is put on the pending list for zfile_exit()
+ */
+static void
+release_image (struct zfile *l)
+{
+    if (l->f) {
+	fclose (l->f);
+	l->f = NULL;
+    }
+
+    l->busy = 0;
+    if (l->compressed && l->re_compress && image_changed (l)) {
+	if (pthread_create (&l->thread, NULL, recompress, l) == 0)
+	    l->busy = 1;
+	else
+	    recompress (l);
+    }
+
+    l->next = zpending;
+    zpending = l;
 }
 
 /*
@@ -105,42 +1656,78 @@ struct zfile *
 zfile_open (const char *name, const char *mode, unsigned short re_compress)
 {
     struct zfile *l;
-    int fd = 0;
+    struct stat st;
+    int src, cached;
+    int ok;
 
     l = malloc (sizeof *l);
     if (!l)
 	return NULL;
 
-    strcpy (l->orgname, name);
-    if (!uncompress (name, NULL)) {
+    /* one open() and one read() tell whether the image is compressed */
+    src = open_image (name, &l->codec, l->orgname, sizeof l->orgname);
+    if (!l->codec) {
+      if (src >= 0)
+	close (src);
       strcpy (l->name, name);
       l->f = fopen (l->name, mode);
+      l->fd = -1;
       l->compressed = 0;
 
       return l;
     }
 
-    tmpnam (l->name);
+    /* an unchanged image might have been decompressed by an earlier run */
+    fstat (src, &st);
+    cached = zcache_lookup (&st, l->name, sizeof l->name);
+    if (cached >= 0 && !re_compress) {
+	/* nothing will be written, use the cached image as it is */
+	close (src);
+	l->fd = cached;
+	l->temporary = 0;
+	ok = 1;
+    } else {
+	/* the image is decompressed into memory, it never touches the disk */
+	l->fd = create_image_file (l);
+	if (l->fd < 0) {
+	    if (cached >= 0)
+		close (cached);
+	    close (src);
+	    free (l);
+	    return NULL;
+	}
 
-    /* On the amiga this would make ixemul loose the break handler */
-    /* ==> fixed in exmul v4.6 */
-    fd = creat (l->name, 0666);
-    if (fd < 0)
-	return NULL;
+	if (cached >= 0) {
+	    ok = zcache_copy (cached, l->fd);
+	    close (cached);
+	    close (src);
+	} else {
+	    ok = decompress_file (l->codec, src, l->fd);
+	    if (ok)
+		zcache_store (&st, l->fd);
+	}
+    }
 
-    if (!uncompress (name, l->name)) {
+    if (!ok) {
+	close (l->fd);
+	if (l->temporary)
+	    unlink (l->name);
 	free (l);
-	close (fd);
-	unlink (l->name);
 	return NULL;
     } else {
       l->compressed = 1;
       l->re_compress = re_compress;
     }
 
+    if (l->re_compress)
+	remember_image (l);
+
     l->f = fopen (l->name, mode);
 
     if (l->f == NULL) {
+	close (l->fd);
+	if (l->temporary)
+	    unlink (l->name);
 	free (l);
 	return NULL;
     }
@@ -154,13 +1741,62 @@ zfile_open (const char *name, const char *mode, unsigned short re_compress)
 FILE *
 f_zfile_open (const char *name, const char *mode, unsigned short re_compress)
 {
-  return zfile_open (name, mode, re_compress)->f;
+  struct zfile *l = zfile_open (name, mode, re_compress);
+
+  return l ? l->f : NULL;
 }
 
 char *
 n_zfile_open (const char *name, const char *mode, unsigned short re_compress)
 {
-  return zfile_open (name, mode, re_compress)->name;
+  struct zfile *l = zfile_open (name, mode, re_compress);
+
+  return l ? l->name : NULL;
+}
+
+/*
+ * reads the first 'len' bytes of an image, unpacking only as much of a
+ * compressed one as needed for that. returns the number of bytes read,
+ * which is less than 'len' if the image is that small, or -1 on error
+ */
+ssize_t
+zfile_read_prefix (const char *name, void *buf, size_t len)
+{
+    char path[PATH_MAX];
+    const struct codec *codec;
+    void *stream;
+    size_t done = 0;
+    ssize_t n = 0;
+    int fd;
+
+    fd = open_image (name, &codec, path, sizeof path);
+    if (fd < 0)
+	return -1;
+
+    if (!codec) {
+	while (done < len) {
+	    n = pread (fd, (char *) buf + done, len - done, done);
+	    if (n < 0 && errno == EINTR)
+		continue;
+	    if (n <= 0)
+		break;
+	    done += n;
+	}
+	close (fd);
+	return n < 0 ? -1 : (ssize_t) done;
+    }
+
+    stream = codec->ropen (fd);
+    if (!stream) {
+	close (fd);
+	return -1;
+    }
+
+    while (done < len && (n = codec->read (stream, (char *) buf + done, len - done)) > 0)
+	done += n;
+
+    codec->rclose (stream);
+    return n < 0 ? -1 : (ssize_t) done;
 }
 
 /*
@@ -171,21 +1807,29 @@ zfile_exit (void)
 {
     struct zfile *l;
 
+    /* start packing all modified images at once... */
     while ((l = zlist)) {
       zlist = l->next;
+      release_image (l);
+    }
+
+    /* ...and wait for them */
+    while ((l = zpending)) {
+      zpending = l->next;
 
-      /* try to compress uncompressed files before cleaning up */
-      if (l->compressed && l->re_compress)
-        compress(l->name, l->orgname);
+      if (l->busy)
+	pthread_join (l->thread, NULL);
 
-      fclose(l->f);
-      unlink(l->name); /* sam: in case unlink() after fopen() fails */
+      close(l->fd);	/* drops the memory of a memfd image */
+      if (l->temporary)
+	unlink(l->name); /* sam: in case unlink() after fopen() fails */
       free(l);
     }
 }
 
 /*
- * fclose() but for a compressed file
+ * fclose() but for a compressed file. a modified image is packed in
+ * the background while the program goes on, zfile_exit() waits for it
  */
 int
 zfile_close (FILE *f)
@@ -201,12 +1845,13 @@ zfile_close (FILE *f)
     if (!l)
 	return fclose(f);
     ret = fclose(l->f);
+    l->f = NULL;
 
     if(!pl)
 	zlist = l->next;
     else
 	pl->next = l->next;
-    free(l);
+    release_image (l);
 
     return ret;
 }
@@ -11,3 +11,6 @@ extern FILE *f_zfile_open(const char *, const char *, unsigned short re_compress
 extern char *n_zfile_open(const char *, const char *, unsigned short re_compress);
 extern int zfile_close(FILE *);
 extern void zfile_exit(void);
+extern int zfile_memfile(char *, size_t);
+extern const char *zfile_stdin(void);
+extern ssize_t zfile_read_prefix(const char *, void *, size_t);
@@ -0,0 +1,457 @@
+/* zindex.c - random access to gzip-compressed images
+ *
+ * adftools - A complete package for maintaining image-files for the best
+ * Amiga-emulator out there: UAE - http://www.freiburg.linux.de/~uae/
+ *
+ * Copyright (C)2002-2015 Rikard Bosnjakovic <bos@hack.org>
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "nativedev.h"
+#include "zindex.h"
+
+/* this is the technique of zran.c from the zlib distribution.  while  */
+/* inflating a gzip image once, the state of the inflater is saved at a */
+/* deflate block boundary every ADFTOOLS_GZINDEX kilobytes: the offsets */
+/* in the compressed and uncompressed data, the bits left over of the   */
+/* byte before the block and the last 32K of uncompressed data.  any    */
+/* offset can then be read by inflating from the closest point before   */
+/* it, rather than from the start of the image.  the points are saved   */
+/* next to the image so later runs get them for free, and the tools     */
+/* that only look at a few blocks of a big hardfile stay fast.          */
+
+#define WINSIZE 32768		/* the deflate window */
+#define CHUNK   16384		/* compressed data read at a time */
+#define ZPAGE   32768		/* unit of uncompressed data kept around */
+#define ZPAGES  64		/* that many of them */
+
+#define ZINDEX_MAGIC "ADFZIDX1"
+
+/* an access point */
+struct point {
+  int64_t out;			/* offset in the uncompressed data */
+  int64_t in;			/* offset in the compressed data */
+  int32_t bits;			/* bits of the byte before 'in' that are used */
+  unsigned char window[WINSIZE];
+};
+
+/* an already inflated piece of the image */
+struct zpage {
+  off_t page;
+  size_t len;
+  unsigned long used;
+  unsigned char data[ZPAGE];
+};
+
+struct zindex {
+  int fd;
+  off_t size;			/* of the uncompressed image */
+  int n_points;
+  struct point *points;
+  unsigned long clock;
+  struct zpage pages[ZPAGES];
+};
+
+/* the index file starts with this, in host byte order (it's a cache) */
+struct zindex_header {
+  char magic[8];
+  int64_t src_size;
+  int64_t src_mtime;
+  int64_t src_mtime_nsec;
+  int64_t size;
+  int32_t n_points;
+  int32_t span;
+};
+
+static struct point *
+add_point (struct zindex *z, int bits, off_t in, off_t out,
+	   unsigned left, unsigned char *window)
+{
+  struct point *p;
+
+  p = realloc (z->points, (z->n_points + 1) * sizeof *p);
+  if (!p)
+    return NULL;
+  z->points = p;
+
+  p += z->n_points++;
+  p->bits = bits;
+  p->in = in;
+  p->out = out;
+
+  /* the window is circular, 'left' bytes of it weren't written this turn */
+  if (left)
+    memcpy (p->window, window + WINSIZE - left, left);
+  if (left < WINSIZE)
+    memcpy (p->window + left, window, WINSIZE - left);
+
+  return p;
+}
+
+/* inflates the whole image once, saving an access point every 'span' bytes */
+static int
+zindex_build (struct zindex *z, off_t span)
+{
+  unsigned char input[CHUNK];
+  unsigned char window[WINSIZE];
+  off_t totin = 0, totout = 0, last = 0;
+  z_stream strm;
+  ssize_t n;
+  int ret;
+
+  /* the first access point saves the window before it's ever filled */
+  memset (window, 0, sizeof window);
+  memset (&strm, 0, sizeof strm);
+  if (inflateInit2 (&strm, 47) != Z_OK)	/* gzip header, please */
+    return 0;
+
+  strm.avail_out = 0;
+  do {
+    n = pread (z->fd, input, CHUNK, totin);
+    if (n <= 0) {
+      ret = Z_DATA_ERROR;
+      break;
+    }
+    strm.avail_in = n;
+    strm.next_in = input;
+
+    do {
+      if (strm.avail_out == 0) {
+	strm.avail_out = WINSIZE;
+	strm.next_out = window;
+      }
+
+      totin += strm.avail_in;
+      totout += strm.avail_out;
+      ret = inflate (&strm, Z_BLOCK);
+      totin -= strm.avail_in;
+      totout -= strm.avail_out;
+
+      if (ret == Z_NEED_DICT || ret == Z_MEM_ERROR)
+	ret = Z_DATA_ERROR;
+      if (ret == Z_DATA_ERROR || ret == Z_STREAM_END)
+	break;
+
+      /* at the end of a deflate block, but not of the last one */
+      if ((strm.data_type & 128) && !(strm.data_type & 64)
+	  && (totout == 0 || totout - last > span)) {
+	if (!add_point (z, strm.data_type & 7, totin, totout,
+			strm.avail_out, window)) {
+	  ret = Z_DATA_ERROR;
+	  break;
+	}
+	last = totout;
+      }
+    } while (strm.avail_in != 0);
+  } while (ret == Z_OK || ret == Z_BUF_ERROR);
+
+  inflateEnd (&strm);
+
+  /* concatenated gzip members are not handled, leave those to zfile */
+  if (ret != Z_STREAM_END || z->n_points == 0
+      || pread (z->fd, input, 1, totin) != 0)
+    return 0;
+
+  z->size = totout;
+  return 1;
+}
+
+/* loads the index of 'st' from 'idxname', if it's there and up to date */
+static int
+zindex_load (struct zindex *z, const char *idxname, const struct stat *st)
+{
+  struct zindex_header hdr;
+  FILE *f;
+  int i;
+
+  f = fopen (idxname, "rb");
+  if (!f)
+    return 0;
+
+  if (fread (&hdr, sizeof hdr, 1, f) != 1
+      || memcmp (hdr.magic, ZINDEX_MAGIC, sizeof hdr.magic) != 0
+      || hdr.src_size != st->st_size
+      || hdr.src_mtime != st->st_mtim.tv_sec
+      || hdr.src_mtime_nsec != st->st_mtim.tv_nsec
+      || hdr.n_points <= 0) {
+    fclose (f);
+    return 0;
+  }
+
+  z->points = malloc (hdr.n_points * sizeof *z->points);
+  if (!z->points) {
+    fclose (f);
+    return 0;
+  }
+
+  for (i = 0; i < hdr.n_points; i++)
+    if (fread (&z->points[i], sizeof *z->points, 1, f) != 1)
+      break;
+  fclose (f);
+
+  if (i < hdr.n_points) {
+    free (z->points);
+    z->points = NULL;
+    return 0;
+  }
+
+  z->n_points = hdr.n_points;
+  z->size = hdr.size;
+  return 1;
+}
+
+/* saves the index next to the image. failing to do so is harmless */
+static void
+zindex_save (struct zindex *z, const char *idxname, const struct stat *st,
+	     off_t span)
+{
+  char tmpname[PATH_MAX + 16];
+  struct zindex_header hdr;
+  FILE *f;
+  int fd, i;
+
+  snprintf (tmpname, sizeof tmpname, "%s.XXXXXX", idxname);
+  fd = mkstemp (tmpname);
+  if (fd < 0)
+    return;
+  fchmod (fd, st->st_mode & 0666);
+
+  f = fdopen (fd, "wb");
+  if (!f) {
+    close (fd);
+    unlink (tmpname);
+    return;
+  }
+
+  memset (&hdr, 0, sizeof hdr);
+  memcpy (hdr.magic, ZINDEX_MAGIC, sizeof hdr.magic);
+  hdr.src_size = st->st_size;
+  hdr.src_mtime = st->st_mtim.tv_sec;
+  hdr.src_mtime_nsec = st->st_mtim.tv_nsec;
+  hdr.size = z->size;
+  hdr.n_points = z->n_points;
+  hdr.span = span;
+
+  fwrite (&hdr, sizeof hdr, 1, f);
+  for (i = 0; i < z->n_points; i++)
+    fwrite (&z->points[i], sizeof *z->points, 1, f);
+
+  if (ferror (f) | fclose (f) || rename (tmpname, idxname) == -1)
+    unlink (tmpname);
+}
+
+/* keeps a page in the least recently used slot */
+static struct zpage *
+store_page (struct zindex *z, off_t page, unsigned char *data, size_t len)
+{
+  struct zpage *slot = &z->pages[0];
+  int i;
+
+  for (i = 0; i < ZPAGES; i++) {
+    if (z->pages[i].used && z->pages[i].page == page) {
+      slot = &z->pages[i];
+      break;
+    }
+    if (z->pages[i].used < slot->used)
+      slot = &z->pages[i];
+  }
+
+  slot->page = page;
+  slot->len = len;
+  slot->used = ++z->clock;
+  memcpy (slot->data, data, len);
+
+  return slot;
+}
+
+/* inflates from the closest access point until 'page' is complete. */
+/* every complete page on the way is kept, neighbours are likely to */
+/* be read next                                                     */
+static struct zpage *
+fill_page (struct zindex *z, off_t page)
+{
+  unsigned char input[CHUNK], buf[ZPAGE];
+  struct zpage *result = NULL;
+  struct point *p;
+  off_t want = page * ZPAGE;
+  off_t pos, start, inpos;
+  size_t fill;
+  z_stream strm;
+  ssize_t n;
+  int lo, hi, mid;
+  int ret = Z_OK;
+
+  /* the last point at or before the wanted offset */
+  lo = 0;
+  hi = z->n_points - 1;
+  while (lo < hi) {
+    mid = (lo + hi + 1) / 2;
+    if (z->points[mid].out <= want)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  p = &z->points[lo];
+
+  memset (&strm, 0, sizeof strm);
+  if (inflateInit2 (&strm, -15) != Z_OK)	/* raw inflate */
+    return NULL;
+
+  inpos = p->in;
+  if (p->bits) {
+    unsigned char c;
+
+    if (pread (z->fd, &c, 1, p->in - 1) != 1) {
+      inflateEnd (&strm);
+      return NULL;
+    }
+    inflatePrime (&strm, p->bits, c >> (8 - p->bits));
+  }
+  inflateSetDictionary (&strm, p->window, WINSIZE);
+
+  pos = p->out;
+  for (;;) {
+    start = pos - pos % ZPAGE;
+    fill = pos % ZPAGE;
+    strm.next_out = buf + fill;
+    strm.avail_out = ZPAGE - fill;
+
+    while (strm.avail_out > 0 && ret != Z_STREAM_END) {
+      if (strm.avail_in == 0) {
+	n = pread (z->fd, input, CHUNK, inpos);
+	if (n <= 0)
+	  goto out;
+	inpos += n;
+	strm.next_in = input;
+	strm.avail_in = n;
+      }
+
+      ret = inflate (&strm, Z_NO_FLUSH);
+      if (ret != Z_OK && ret != Z_STREAM_END)
+	goto out;
+    }
+
+    pos = start + ZPAGE - strm.avail_out;
+
+    /* the first page is incomplete if the point is not on a page boundary */
+    if (start >= p->out) {
+      struct zpage *zp = store_page (z, start / ZPAGE, buf, pos - start);
+
+      if (start == want)
+	result = zp;
+    }
+
+    if (start >= want || ret == Z_STREAM_END)
+      break;
+  }
+
+ out:
+  inflateEnd (&strm);
+  return result;
+}
+
+static int
+zindex_read (void *priv, off_t offset, size_t len, unsigned char *buf)
+{
+  struct zindex *z = priv;
+  struct zpage *zp;
+  size_t skip, n;
+  int i;
+
+  while (len > 0) {
+    zp = NULL;
+    for (i = 0; i < ZPAGES; i++)
+      if (z->pages[i].used && z->pages[i].page == offset / ZPAGE) {
+	zp = &z->pages[i];
+	zp->used = ++z->clock;
+	break;
+      }
+
+    if (!zp)
+      zp = fill_page (z, offset / ZPAGE);
+
+    skip = offset % ZPAGE;
+    if (!zp || zp->len <= skip)
+      return 0;
+
+    n = zp->len - skip < len ? zp->len - skip : len;
+    memcpy (buf, zp->data + skip, n);
+    buf += n;
+    offset += n;
+    len -= n;
+  }
+
+  return 1;
+}
+
+static void
+zindex_release (void *priv)
+{
+  struct zindex *z = priv;
+
+  close (z->fd);
+  free (z->points);
+  free (z);
+}
+
+static const struct nativedev_ops zindex_ops = {
+  zindex_read,
+  NULL,				/* read-only */
+  zindex_release,
+  NULL
+};
+
+/* registers the gzip image 'name' with the native device driver, if it */
+/* has an up to date index or ADFTOOLS_GZINDEX asks for one to be built */
+int
+zindex_register (const char *name)
+{
+  char idxname[PATH_MAX];
+  unsigned char magic[2];
+  struct zindex *z;
+  struct stat st;
+  char *env;
+  off_t span = 0;
+
+  z = calloc (1, sizeof *z);
+  if (!z)
+    return 0;
+
+  z->fd = open (name, O_RDONLY | O_CLOEXEC);
+  if (z->fd < 0) {
+    free (z);
+    return 0;
+  }
+
+  if (pread (z->fd, magic, 2, 0) != 2 || magic[0] != 0x1f || magic[1] != 0x8b
+      || fstat (z->fd, &st) == -1)
+    goto fail;
+
+  snprintf (idxname, sizeof idxname, "%s%s", name, ZINDEX_SUFFIX);
+  if (!zindex_load (z, idxname, &st)) {
+    env = getenv (ZINDEX_ENV);
+    if (env)
+      span = (off_t) atol (env) * 1024;
+    if (span <= 0 || !zindex_build (z, span) || !nativedev_fits (z->size))
+      goto fail;
+
+    zindex_save (z, idxname, &st, span);
+  }
+
+  if (nativedev_fits (z->size) && nativedev_register (name, z->size, &zindex_ops, z))
+    return 1;
+
+ fail:
+  zindex_release (z);
+  return 0;
+}
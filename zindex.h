@@ -0,0 +1,12 @@
+#ifndef ADFTOOLS_ZINDEX_H
+#define ADFTOOLS_ZINDEX_H 1
+
+/* name of the environment variable that enables building of indexes */
+#define ZINDEX_ENV "ADFTOOLS_GZINDEX"
+
+/* the index of "foo.adz" is kept in "foo.adz.zidx" */
+#define ZINDEX_SUFFIX ".zidx"
+
+int zindex_register (const char *name);
+
+#endif /* ADFTOOLS_ZINDEX_H */